@@ -5,7 +5,31 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define STATES_MAX        100000  /* most states a RegExp may compile to */
+#define REPEAT_MAX        65535   /* largest count in {n,m} */
+#define REPEAT_UNROLL_MAX 8       /* larger {n,m} use a counter */
+#define LITERALS_MAX      65536   /* most strings kept as literals */
+#define LITERALS_SIZE     (1 << 20) /* most bytes in them */
+#define REQUIRED_MIN      2       /* shortest required string used */
+#define REQUIRED_MAX      64      /* longest kept */
+#define REQUIRED_STATES_MAX 4096  /* largest RegExp looked at for one */
+#define ONEPASS_MAX       1024    /* most positions of a one-pass table */
+
+#define REGEX_UTF8        0x1     /* symbols are UTF-8 characters */
+#define REGEX_ICASE       0x2     /* letters match in either case */
 
 
 typedef enum {
@@ -15,39 +39,161 @@ typedef enum {
         OP_STOP_UNION,   /* ']' */
         OP_START_CONCAT, /* '(' */
         OP_STOP_CONCAT,  /* ')' */
+        OP_START_REPEAT, /* '{' */
+        OP_STOP_REPEAT,  /* '}' */
 } element_type_t;
 
 
+typedef enum {
+        MATCH_FULL,      /* the whole input */
+        MATCH_PREFIX,    /* any prefix of the input, stop at the first */
+        MATCH_SHORTEST,  /* the shortest matching prefix */
+        MATCH_LONGEST,   /* the longest matching prefix */
+} match_mode_t;
+
+
+/* how one match is run, see engine_choose() */
+typedef enum {
+        ENGINE_AUTO,     /* chosen per pattern and input */
+        ENGINE_NFA,      /* pebbles on the states, run_feed() */
+        ENGINE_DFA,      /* dfa_build(), then a table lookup per byte */
+        ENGINE_BACKTRACK,/* depth first, backtrack_match() */
+        ENGINE_ONEPASS,  /* one state per byte, onepass_match() */
+} engine_t;
+
+
+/* what match_regex() returns when it cannot tell */
+typedef enum {
+        MATCH_ERR_NOMEM  = -1, /* out of memory */
+        MATCH_ERR_STEPS  = -2, /* more than max_steps */
+        MATCH_ERR_MEMORY = -3, /* more than max_memory */
+        MATCH_ERR_STATES = -4, /* regex has more than max_states */
+        MATCH_ERR_READ   = -5, /* the input could not be read */
+} match_err_t;
+
+
+/*
+ * Budget of one match_regex() call, 0 means no limit. Going over it
+ * gives the MATCH_ERR_ for it, never an accept or reject.
+ */
+struct match_limits {
+        unsigned long      max_steps;   /* work, see match_regex() */
+        size_t             max_memory;  /* bytes of working memory */
+        int                max_states;
+};
+
+
 struct transition;
 struct state;
+struct counter;
 
 
 struct transition {
         struct transition *next;
-#define E 0
-        char label;                  /* 0 label = E transition */
+#define ANY     256                 /* '.' - matches any byte */
+#define RANGE   257                 /* any byte from lo to hi */
+#define E       258                 /* E transition, consumes no input */
+#define E_ENTER 259                 /* E, into a counted repetition */
+#define E_BODY  260                 /* E, one more round if count < max */
+#define E_AGAIN 261                 /* E, end of a round, count++ */
+#define E_EXIT  262                 /* E, out of it if count >= min */
+#define is_E(label) ((label) >= E)
+        int label;                  /* 0-255 = byte, or ANY, RANGE, E* */
+        uint8_t lo;
+        uint8_t hi;
+        int idx;                    /* 0 .. ntransitions-1, for profiles */
         struct state *to;
 };
 
 
+struct counter {
+        struct counter    *next;        /* list of all counters */
+        int                min;         /* rounds needed to get out */
+        int                max;         /* rounds allowed */
+        int                words;       /* size of a set of counts 0..max */
+        int                toff;        /* scratch set, in run->counts */
+};
+
+
 struct state {
         struct state       *next;       /* list of all related states */
         struct state       *prev;
-
-        char               pebble;       /* is placed */
-        char               next_pebble;  /* is placed */
+        struct state       *alloc;      /* list of all allocated states */
 
         char               ch;
         int                id;          /* Unique identifier, per state */
         int                is_start;    /* 0 = false, 1 = true */
         int                is_final;    /* 0 = false, 1 = true */
+        int                is_live;     /* a final state is reachable */
         int                E_source;    /* is a source of an E transition */
+        int                idx;         /* 0 .. nstates-1, for run arrays */
+        struct counter    *counter;     /* counted repetition this is in */
+        int                coff;        /* its sets of counts, in run->counts */
         struct transition *transitions; /* list of transitions from here */
 };
 
 
+/* a set of strings, one after the other in bytes */
+struct literals {
+        int                count;
+        size_t            *ends;        /* of each string, in bytes */
+        uint8_t           *bytes;
+        size_t             len;
+        size_t             size;        /* room in bytes */
+};
+
+
+/* a string every match contains, see regex_required() */
+struct required {
+        uint8_t            bytes[REQUIRED_MAX]; /* folded */
+        size_t             len;
+        uint8_t            fold[256];   /* other case of a letter to it */
+        long               before;      /* most bytes of a match before */
+        long               after;       /* and after it, -1 no limit */
+        int                always;      /* any occurrence is a match */
+        size_t             skip[256];   /* Horspool shift, by last byte */
+};
+
+
+/* the one way through a one-pass RegExp, see regex_onepass() */
+struct onepass {
+        int                npositions;
+        int               *next;        /* position * 256 + byte to next */
+        uint8_t           *accept;      /* a final state in E reach */
+};
+
+
+/*
+ * A compiled RegExp. It is never modified once compiled, everything a
+ * match changes lives in a struct run, so one regex can be matched by
+ * many threads at the same time.
+ */
+struct regex {
+        struct state       start;       /* ring of all the states */
+        struct state      *states;      /* allocated, excluding start */
+        struct counter    *counters;
+        int                nstates;
+        int                ntransitions;
+        int                cwords;      /* run->counts needed */
+        int                flags;       /* REGEX_* it was compiled with */
+        struct literals   *literals;    /* all it matches, if that few */
+        struct required   *required;    /* in all matches, or NULL */
+        struct onepass    *onepass;     /* if it is one-pass, or NULL */
+        size_t             size;        /* bytes held */
+        int                refs;
+
+        /* owned by the regex_cache */
+        struct regex      *hash_next;
+        struct regex      *lru_prev;
+        struct regex      *lru_next;
+        uint64_t           hash;
+        uint8_t           *pattern;
+        size_t             len;
+};
+
+
 element_type_t
-element_type (char element)
+element_type (uint8_t element)
 {
         element_type_t type = SYMBOL;
 
@@ -57,6 +203,8 @@ element_type (char element)
         case ')': type = OP_STOP_CONCAT; break;
         case '[': type = OP_START_UNION; break;
         case ']': type = OP_STOP_UNION; break;
+        case '{': type = OP_START_REPEAT; break;
+        case '}': type = OP_STOP_REPEAT; break;
         }
 
         return type;
@@ -130,7 +278,7 @@ state_splice (struct state *one, struct state *two)
 
 
 struct state *
-new_state (int id)
+new_state (struct regex *regex, int id)
 {
         struct state *newstate = NULL;
 
@@ -140,27 +288,31 @@ new_state (int id)
         newstate->next = newstate;
         newstate->prev = newstate;
 
+        newstate->alloc = regex->states;
+        regex->states = newstate;
+        regex->nstates++;
+
         return newstate;
 }
 
 
 struct state *
-new_start_state (int id)
+new_start_state (struct regex *regex, int id)
 {
         struct state *newstate = NULL;
 
-        newstate = new_state (id);
+        newstate = new_state (regex, id);
         newstate->is_start = 1;
 
         return newstate;
 }
 
 struct state *
-new_final_state (int id)
+new_final_state (struct regex *regex, int id)
 {
         struct state *newstate = NULL;
 
-        newstate = new_state (id);
+        newstate = new_state (regex, id);
         newstate->is_final = 1;
 
         return newstate;
@@ -168,7 +320,7 @@ new_final_state (int id)
 
 
 struct transition *
-new_transition (char label)
+new_transition (int label)
 {
         struct transition *newtrans = NULL;
 
@@ -180,7 +332,17 @@ new_transition (char label)
 
 
 int
-state_transition (struct state *from, struct state *to, char label)
+transition_matches (struct transition *trans, uint8_t byte)
+{
+        if (trans->label == RANGE)
+                return (byte >= trans->lo && byte <= trans->hi);
+
+        return (trans->label == byte || trans->label == ANY);
+}
+
+
+int
+state_transition (struct state *from, struct state *to, int label)
 {
         struct transition *newtrans = NULL;
 
@@ -191,18 +353,18 @@ state_transition (struct state *from, struct state *to, char label)
         newtrans->next = from->transitions;
         from->transitions = newtrans;
 
-        if (label == E)
+        if (is_E (label))
                 from->E_source = 1;
         return 0;
 }
 
 
 struct state *
-add_symbol (struct state *start, char label, int idx)
+add_symbol (struct regex *regex, struct state *start, int label, int idx)
 {
         struct state *symstate = NULL;
 
-        symstate = new_final_state (idx);
+        symstate = new_final_state (regex, idx);
         symstate->ch = start->ch;
 
         state_transition (start, symstate, label);
@@ -213,6 +375,201 @@ add_symbol (struct state *start, char label, int idx)
 }
 
 
+int
+state_range_transition (struct state *from, struct state *to,
+                        uint8_t lo, uint8_t hi)
+{
+        if (lo == hi)
+                return state_transition (from, to, lo);
+
+        if (lo == 0x00 && hi == 0xff)
+                return state_transition (from, to, ANY);
+
+        state_transition (from, to, RANGE);
+
+        from->transitions->lo = lo;
+        from->transitions->hi = hi;
+
+        return 0;
+}
+
+
+struct state *
+add_range (struct regex *regex, struct state *start, uint8_t lo, uint8_t hi,
+           int idx)
+{
+        struct state *symstate = NULL;
+
+        symstate = new_final_state (regex, idx);
+        symstate->ch = start->ch;
+
+        state_range_transition (start, symstate, lo, hi);
+
+        state_splice (start, symstate);
+
+        return start;
+}
+
+
+int
+utf8_encode (uint32_t cp, uint8_t *buf)
+{
+        if (cp < 0x80) {
+                buf[0] = cp;
+                return 1;
+        }
+
+        if (cp < 0x800) {
+                buf[0] = 0xc0 | (cp >> 6);
+                buf[1] = 0x80 | (cp & 0x3f);
+                return 2;
+        }
+
+        if (cp < 0x10000) {
+                buf[0] = 0xe0 | (cp >> 12);
+                buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+                buf[2] = 0x80 | (cp & 0x3f);
+                return 3;
+        }
+
+        buf[0] = 0xf0 | (cp >> 18);
+        buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+        buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[3] = 0x80 | (cp & 0x3f);
+        return 4;
+}
+
+
+/* returns the length of the character at @buf, 0 if it is not UTF-8 */
+size_t
+utf8_decode (const uint8_t *buf, size_t len, uint32_t *cp)
+{
+        size_t   n = 0;
+        size_t   i = 0;
+        uint32_t min = 0;
+
+        if (buf[0] < 0x80) {
+                *cp = buf[0];
+                return 1;
+        }
+
+        if (buf[0] >= 0xc2 && buf[0] <= 0xdf) {
+                n = 2; min = 0x80; *cp = buf[0] & 0x1f;
+        } else if (buf[0] >= 0xe0 && buf[0] <= 0xef) {
+                n = 3; min = 0x800; *cp = buf[0] & 0x0f;
+        } else if (buf[0] >= 0xf0 && buf[0] <= 0xf4) {
+                n = 4; min = 0x10000; *cp = buf[0] & 0x07;
+        } else {
+                return 0;
+        }
+
+        if (n > len)
+                return 0;
+
+        for (i = 1; i < n; i++) {
+                if ((buf[i] & 0xc0) != 0x80)
+                        return 0;
+                *cp = (*cp << 6) | (buf[i] & 0x3f);
+        }
+
+        if (*cp < min || *cp > 0x10ffff ||
+            (*cp >= 0xd800 && *cp <= 0xdfff))
+                return 0;
+
+        return n;
+}
+
+
+/*
+ * Add a path from @start to @done for every UTF-8 encoding of the code
+ * points @lo to @hi. The range is split until each piece encodes to a
+ * fixed sequence of byte ranges, so no decoding is needed to match.
+ */
+int
+add_utf8_paths (struct regex *regex, struct state *start,
+                struct state *done, uint32_t lo, uint32_t hi)
+{
+        static const uint32_t limits[] = { 0x7f, 0x7ff, 0xffff };
+        struct state         *prev = NULL;
+        struct state         *next = NULL;
+        uint8_t               from[4];
+        uint8_t               to[4];
+        uint32_t              m = 0;
+        int                   n = 0;
+        int                   i = 0;
+
+        if (lo > hi)
+                return 0;
+
+        /* surrogates are not characters */
+        if (lo <= 0xdfff && hi >= 0xd800) {
+                if (lo < 0xd800)
+                        add_utf8_paths (regex, start, done, lo, 0xd7ff);
+                if (hi > 0xdfff)
+                        add_utf8_paths (regex, start, done, 0xe000, hi);
+                return 0;
+        }
+
+        /* same encoded length */
+        for (i = 0; i < 3; i++) {
+                if (lo <= limits[i] && hi > limits[i]) {
+                        add_utf8_paths (regex, start, done, lo, limits[i]);
+                        add_utf8_paths (regex, start, done, limits[i] + 1, hi);
+                        return 0;
+                }
+        }
+
+        /* same leading bytes, all continuation bytes ranging fully */
+        for (i = 1; hi >= 0x80 && i < 4; i++) {
+                m = (1U << (6 * i)) - 1;
+                if ((lo & ~m) == (hi & ~m))
+                        continue;
+                if ((lo & m) != 0) {
+                        add_utf8_paths (regex, start, done, lo, lo | m);
+                        add_utf8_paths (regex, start, done, (lo | m) + 1, hi);
+                        return 0;
+                }
+                if ((hi & m) != m) {
+                        add_utf8_paths (regex, start, done, lo, (hi & ~m) - 1);
+                        add_utf8_paths (regex, start, done, hi & ~m, hi);
+                        return 0;
+                }
+        }
+
+        n = utf8_encode (lo, from);
+        utf8_encode (hi, to);
+
+        prev = start;
+        for (i = 0; i < n - 1; i++) {
+                next = new_state (regex, done->id - 1);
+                next->ch = start->ch;
+                state_range_transition (prev, next, from[i], to[i]);
+                state_splice (start, next);
+                prev = next;
+        }
+        state_range_transition (prev, done, from[n - 1], to[n - 1]);
+
+        return 0;
+}
+
+
+struct state *
+add_codepoints (struct regex *regex, struct state *start, uint32_t lo,
+                uint32_t hi, int idx)
+{
+        struct state *done = NULL;
+
+        done = new_final_state (regex, idx);
+        done->ch = start->ch;
+
+        add_utf8_paths (regex, start, done, lo, hi);
+
+        state_splice (start, done);
+
+        return start;
+}
+
+
 int
 E_transition_if_final (struct state *each, void *data)
 {
@@ -291,279 +648,6197 @@ add_concat (struct state *left, struct state *right)
 
 
 struct state *
-next_subex (const char *regex, int *idx, struct state *prev)
+add_optional (struct state *left, struct state *right)
 {
-        struct state *newstate = NULL;
-        struct state *subex = NULL;
-        struct state *ret = NULL;
-
-        switch (element_type (regex[*idx])) {
+        /* like add_concat, but @left can still accept on its own */
+        state_foreach (left, E_transition_if_final, right);
 
-        case SYMBOL:
-                newstate = new_start_state (*idx);
-                newstate->ch = regex[*idx];
+        right->is_start = 0;
 
-                add_symbol (newstate, regex[*idx], (*idx));
-                ret = newstate;
-                break;
+        state_splice (left, right);
 
-        case OP_CLOSURE:
-                newstate = new_start_state (*idx);
-                newstate->ch = regex[*idx];
+        return left;
+}
 
-                if (!prev) {
-                        fprintf (stderr,
-                                 "RegExp is not balanced. unexpected *\n");
-                        return NULL;
-                }
 
-                /* since closure is a post-op in RegExp syntax,
-                   the manipulated node is really @prev
-                */
-                add_closure (newstate, prev);
-                ret = newstate;
-                break;
+int
+E_again_if_final (struct state *each, void *data)
+{
+        struct state *loop = NULL;
 
-        case OP_START_UNION:
-                newstate = new_start_state (*idx);
-                newstate->ch = regex[*idx];
+        loop = data;
 
-                (*idx)++;
+        if (each->is_final) {
+                state_transition (each, loop, E_AGAIN);
+        }
 
-                while (regex[*idx]) {
-                        if (element_type (regex[*idx]) == OP_STOP_UNION)
-                                break;
+        return 0;
+}
 
-                        subex = next_subex (regex, idx, subex);
 
-                        if (!subex)
-                                return NULL;
+int
+enter_counter (struct state *each, void *data)
+{
+        struct counter *counter = NULL;
 
-                        add_union (newstate, subex);
-                        subex = newstate;
-                        (*idx)++;
-                }
+        counter = data;
 
-                if (element_type (regex[*idx]) != OP_STOP_UNION) {
-                        fprintf (stderr,
-                                 "RegExp is not balanced with a closing ]\n");
-                        return NULL;
-                }
+        if (each->counter) /* already counting for an inner repetition */
+                return 1;
 
-                ret = newstate;
-                break;
+        each->counter = counter;
 
-        case OP_START_CONCAT:
-                (*idx)++;
-                while (regex[*idx]) {
-                        if (element_type (regex[*idx]) == OP_STOP_CONCAT)
-                                break;
+        return 0;
+}
 
-                        subex = next_subex (regex, idx, subex);
 
-                        if (!subex)
-                                return NULL;
+struct state *
+add_counter (struct regex *regex, struct state *newstate,
+             struct state *subex, struct counter *counter)
+{
+        struct state *loop = NULL;
+        struct state *done = NULL;
 
-                        newstate = add_concat (newstate, subex);
-                        subex = newstate;
-                        (*idx)++;
-                }
+        if (state_foreach (subex, enter_counter, counter)) {
+                fprintf (stderr,
+                         "RegExp has nested repetitions too large to "
+                         "unroll\n");
+                return NULL;
+        }
 
-                if (element_type (regex[*idx]) != OP_STOP_CONCAT) {
-                        fprintf (stderr, "RegExp is not balanced with a closing )\n");
-                        return NULL;
-                }
+        loop = new_state (regex, newstate->id - 1);
+        loop->ch = newstate->ch;
+        enter_counter (loop, counter);
 
-                ret = newstate;
-                break;
+        done = new_final_state (regex, newstate->id - 1);
+        done->ch = newstate->ch;
 
-        case OP_STOP_CONCAT:
-                fprintf (stderr, "RegExp is not balanced ... unexpected ')'\n");
-                return NULL;
+        state_foreach (subex, E_again_if_final, loop);
+        state_foreach (subex, unfinalize, NULL);
+        subex->is_start = 0;
 
-        case OP_STOP_UNION:
-                fprintf (stderr, "RegExp is not balanced ... unexpected ']'\n");
-                return NULL;
-        }
+        state_transition (newstate, loop, E_ENTER);
+        state_transition (loop, subex, E_BODY);
+        state_transition (loop, done, E_EXIT);
 
-        /* peek ahead */
-        if (element_type (regex[(*idx)+1]) == OP_CLOSURE) {
-                (*idx)++;
-                ret = next_subex (regex, idx, ret);
-        }
+        state_splice (newstate, loop);
+        state_splice (newstate, subex);
+        state_splice (newstate, done);
 
-        return ret;
+        return newstate;
 }
 
 
 int
-parse_regex (struct state *start, const char *regex)
+count_state (struct state *each, void *data)
 {
-        int idx = 0;
-        struct state *subex = NULL;
+        int *count = NULL;
 
-        while (regex[idx]) {
-                subex = next_subex (regex, &idx, start);
-                if (!subex)
-                        return -1;
-                add_concat (start, subex);
-                idx++;
-        }
+        count = data;
+
+        (*count)++;
 
         return 0;
 }
 
 
-int place_pebble (struct state *state);
+struct parser {
+        const uint8_t *regex;   /* not NUL terminated */
+        size_t         len;
+        size_t         idx;     /* element being parsed */
+        int            flags;   /* REGEX_* */
+        int            in_union;
+        struct regex  *compiled;
+};
 
-int
-place_pebble_if_E_transition (struct state *state, struct transition *each,
-                              void *data)
-{
-        if (each->label == E)
-                place_pebble (each->to);
 
-        return 0;
-}
+struct state *
+next_subex (struct parser *parser, struct state *prev);
 
-int
-place_pebble (struct state *state)
-{
-        if (state->next_pebble)
-                return 0;
 
-        state->next_pebble = 1;
+struct state *
+copy_subex (struct parser *parser, size_t atom, size_t brace, int in_union)
+{
+        struct parser copy = *parser;
 
-        transition_foreach (state, place_pebble_if_E_transition, NULL);
+        /* parse regex[@atom] up to, but not including, the '{' again,
+           as directly inside [ ] if it was, for ranges */
+        copy.idx = atom;
+        copy.len = brace;
+        copy.in_union = in_union;
 
-        return 0;
+        return next_subex (&copy, NULL);
 }
 
 
 int
-attempt_move (struct state *state, struct transition *each,
-              void *data)
+next_bound (struct parser *parser, int *bound)
 {
-        char *input = NULL;
-        int   ret = 0;
-
-        input = data;
-
-        if ((each->label == (*input)) || (each->label == '.')) {
-                place_pebble (each->to);
-                if (state->E_source)
-                        state->pebble = 1;
-                ret = 1;
+        int digits = 0;
+
+        *bound = 0;
+
+        while (parser->idx < parser->len &&
+               parser->regex[parser->idx] >= '0' &&
+               parser->regex[parser->idx] <= '9') {
+                if (*bound <= REPEAT_MAX)
+                        *bound = (*bound * 10) +
+                                (parser->regex[parser->idx] - '0');
+                parser->idx++;
+                digits++;
         }
 
-        return ret;
+        return digits;
 }
 
 
 int
-move_pebble (struct state *state, void *data)
+next_bounds (struct parser *parser, int *min, int *max)
 {
-        if (!state->pebble)
-                return 0;
+        parser->idx++; /* '{' */
 
-        state->pebble = 0; /* Guilty until proven innocent -
-                              attempt_move will set this pebble
-                              back if it is a source of any E
-                              transitions, and if it has a non-E
-                              transition for this input */
-        transition_foreach (state, attempt_move, data);
+        if (!next_bound (parser, min))
+                return -1;
 
-        return 0;
-}
+        *max = *min;
 
+        if (parser->idx < parser->len && parser->regex[parser->idx] == ',') {
+                parser->idx++;
+                if (!next_bound (parser, max))
+                        *max = -1; /* {n,} */
+        }
 
+        if (parser->idx >= parser->len ||
+            element_type (parser->regex[parser->idx]) != OP_STOP_REPEAT)
+                return -1;
 
-int
-place_pebble_if_start (struct state *state, void *data)
-{
-        if (state->is_start)
-                place_pebble (state);
+        if (*max != -1 && *max < *min)
+                return -1;
 
         return 0;
 }
 
 
-int
-pebble_in_final (struct state *state, void *data)
+/*
+ * @subex was parsed from regex[@atom] up to the '{' at parser->idx.
+ * Small counts are unrolled by parsing that text once more for every
+ * copy, large ones loop through @subex with a counter instead.
+ */
+struct state *
+next_repeat (struct parser *parser, size_t atom, int in_union,
+             struct state *subex)
 {
-        if (state->pebble && state->is_final)
-                return 1;
+        size_t          brace = 0;
+        int             min = 0;
+        int             max = 0;
+        int             copies = 0;
+        int             size = 0;
+        int             i = 0;
+        struct state   *copy = NULL;
+        struct state   *opt = NULL;
+        struct state   *newstate = NULL;
+        struct state   *ret = NULL;
+        struct counter *counter = NULL;
+
+        brace = parser->idx;
+
+        if (next_bounds (parser, &min, &max) != 0) {
+                fprintf (stderr, "RegExp has a malformed {n,m}\n");
+                return NULL;
+        }
 
-        return 0;
-}
+        if (min > REPEAT_MAX || max > REPEAT_MAX) {
+                fprintf (stderr, "RegExp repeats more than %d times\n",
+                         REPEAT_MAX);
+                return NULL;
+        }
 
+        state_foreach (subex, count_state, &size);
 
-int
-commit_pebble (struct state *state, void *data)
-{
-        if (state->next_pebble) {
-                state->pebble = 1;
-                state->next_pebble = 0;
-        }
+        copies = (max == -1) ? min + 1 : max;
 
-        return 0;
-}
+        if (copies > REPEAT_UNROLL_MAX) {
+                /* x{n,} is x{n} followed by x* */
+                if (max == -1)
+                        opt = copy_subex (parser, atom, brace, in_union);
 
+                newstate = new_start_state (parser->compiled, brace);
+                newstate->ch = '{';
 
+                counter = calloc (1, sizeof (*counter));
+                counter->min = min;
+                counter->max = (max == -1) ? min : max;
+                counter->words = (counter->max / 64) + 1;
+                counter->next = parser->compiled->counters;
+                parser->compiled->counters = counter;
+
+                ret = add_counter (parser->compiled, newstate, subex,
+                                   counter);
+                if (!ret || !opt)
+                        return ret;
+
+                newstate = new_start_state (parser->compiled, brace);
+                newstate->ch = '*';
+
+                return add_concat (ret, add_closure (newstate, opt));
+        }
+
+        if (copies * size > STATES_MAX) {
+                fprintf (stderr, "RegExp compiles to more than %d states\n",
+                         STATES_MAX);
+                return NULL;
+        }
+
+        /* x{n,m} is n copies of x, followed by m - n optional ones */
+        for (i = 1; i <= min; i++) {
+                copy = (i == 1) ? subex :
+                        copy_subex (parser, atom, brace, in_union);
+                ret = add_concat (ret, copy);
+        }
+
+        if (max == -1) {
+                copy = (min == 0) ? subex :
+                        copy_subex (parser, atom, brace, in_union);
+
+                newstate = new_start_state (parser->compiled, brace);
+                newstate->ch = '*';
+
+                return add_concat (ret, add_closure (newstate, copy));
+        }
+
+        for (i = max; i > min; i--) {
+                copy = (i == 1) ? subex :
+                        copy_subex (parser, atom, brace, in_union);
+                opt = opt ? add_optional (copy, opt) : copy;
+        }
+
+        if (!ret) {
+                /* x{0,m} and x{0} also accept the empty input */
+                newstate = new_final_state (parser->compiled, brace);
+                newstate->is_start = 1;
+                newstate->ch = '{';
+
+                ret = add_concat (ret, newstate);
+        }
+
+        if (opt)
+                ret = add_optional (ret, opt);
+
+        return ret;
+}
+
+
+struct fold {
+        uint32_t           lo;
+        uint32_t           hi;
+        int                delta;       /* to the other case */
+        int                step;        /* 2 where the cases alternate */
+};
+
+
+/* simple one to one case pairs, both ways: ASCII, Latin-1,
+   Latin Extended-A, Greek and Cyrillic */
+const struct fold folds[] = {
+        { 'A',   'Z',     32, 1 }, { 'a',   'z',    -32, 1 },
+        { 0xc0,  0xd6,    32, 1 }, { 0xe0,  0xf6,   -32, 1 },
+        { 0xd8,  0xde,    32, 1 }, { 0xf8,  0xfe,   -32, 1 },
+        { 0xff,  0xff,   121, 1 }, { 0x178, 0x178, -121, 1 },
+        { 0x100, 0x12f,    1, 2 }, { 0x101, 0x12f,   -1, 2 },
+        { 0x132, 0x137,    1, 2 }, { 0x133, 0x137,   -1, 2 },
+        { 0x139, 0x148,    1, 2 }, { 0x13a, 0x148,   -1, 2 },
+        { 0x14a, 0x177,    1, 2 }, { 0x14b, 0x177,   -1, 2 },
+        { 0x179, 0x17e,    1, 2 }, { 0x17a, 0x17e,   -1, 2 },
+        { 0x386, 0x386,   38, 1 }, { 0x3ac, 0x3ac,  -38, 1 },
+        { 0x388, 0x38a,   37, 1 }, { 0x3ad, 0x3af,  -37, 1 },
+        { 0x38c, 0x38c,   64, 1 }, { 0x3cc, 0x3cc,  -64, 1 },
+        { 0x38e, 0x38f,   63, 1 }, { 0x3cd, 0x3ce,  -63, 1 },
+        { 0x391, 0x3a1,   32, 1 }, { 0x3b1, 0x3c1,  -32, 1 },
+        { 0x3a3, 0x3ab,   32, 1 }, { 0x3c3, 0x3cb,  -32, 1 },
+        { 0x3a3, 0x3a3,   31, 1 }, { 0x3c2, 0x3c2,  -31, 1 },
+        { 0x3c2, 0x3c2,    1, 1 }, { 0x3c3, 0x3c3,   -1, 1 },
+        { 0x400, 0x40f,   80, 1 }, { 0x450, 0x45f,  -80, 1 },
+        { 0x410, 0x42f,   32, 1 }, { 0x430, 0x44f,  -32, 1 },
+        { 0x460, 0x481,    1, 2 }, { 0x461, 0x481,   -1, 2 },
+        { 0x48a, 0x4bf,    1, 2 }, { 0x48b, 0x4bf,   -1, 2 },
+};
+
+
+size_t
+next_char (struct parser *parser, size_t idx, uint32_t *cp)
+{
+        if (!(parser->flags & REGEX_UTF8)) {
+                *cp = parser->regex[idx];
+                return 1;
+        }
+
+        return utf8_decode (parser->regex + idx, parser->len - idx, cp);
+}
+
+
+/*
+ * A symbol is a byte, or a whole character in UTF-8 mode. Directly
+ * inside a union 'x-y' stands for all the symbols from x to y.
+ */
+void
+add_symbols (struct parser *parser, struct state *newstate, uint32_t lo,
+             uint32_t hi)
+{
+        if (parser->flags & REGEX_UTF8)
+                add_codepoints (parser->compiled, newstate, lo, hi, parser->idx);
+        else
+                add_range (parser->compiled, newstate, lo, hi, parser->idx);
+}
+
+
+/*
+ * Let @newstate also take the other case of the symbols from @lo to
+ * @hi. Only ASCII letters have another case when symbols are bytes.
+ */
+void
+add_other_case (struct parser *parser, struct state *newstate, uint32_t lo,
+                uint32_t hi)
+{
+        const struct fold *fold = NULL;
+        uint32_t           a = 0;
+        uint32_t           b = 0;
+
+        for (fold = folds; fold < folds + sizeof (folds) / sizeof (*fold);
+             fold++) {
+                if (!(parser->flags & REGEX_UTF8) && fold->hi > 0x7f)
+                        continue;
+
+                a = (lo > fold->lo) ? lo : fold->lo;
+                b = (hi < fold->hi) ? hi : fold->hi;
+                if (a > b)
+                        continue;
+
+                if (fold->step == 1) {
+                        add_symbols (parser, newstate, a + fold->delta,
+                                     b + fold->delta);
+                        continue;
+                }
+
+                if ((a - fold->lo) % 2)
+                        a++;
+
+                for (; a <= b; a += 2)
+                        add_symbols (parser, newstate, a + fold->delta,
+                                     a + fold->delta);
+        }
+}
+
+
+int
+next_symbol (struct parser *parser, struct state *newstate, int in_union)
+{
+        const uint8_t *regex = NULL;
+        size_t         n = 0;
+        size_t         m = 0;
+        uint32_t       lo = 0;
+        uint32_t       hi = 0;
+
+        regex = parser->regex;
+
+        if (regex[parser->idx] == '.') {
+                if (parser->flags & REGEX_UTF8)
+                        add_codepoints (parser->compiled, newstate, 0,
+                                        0x10ffff, parser->idx);
+                else
+                        add_symbol (parser->compiled, newstate, ANY,
+                                    parser->idx);
+                return 0;
+        }
+
+        n = next_char (parser, parser->idx, &lo);
+        hi = lo;
+
+        if (n && in_union && parser->idx + n + 1 < parser->len &&
+            regex[parser->idx + n] == '-' &&
+            regex[parser->idx + n + 1] != '.' &&
+            element_type (regex[parser->idx + n + 1]) == SYMBOL) {
+                m = next_char (parser, parser->idx + n + 1, &hi);
+                if (!m) {
+                        n = 0;
+                } else if (hi < lo) {
+                        fprintf (stderr, "RegExp has a range out of order\n");
+                        return -1;
+                } else {
+                        n += m + 1;
+                }
+        }
+
+        if (!n) {
+                fprintf (stderr, "RegExp is not valid UTF-8\n");
+                return -1;
+        }
+
+        add_symbols (parser, newstate, lo, hi);
+
+        if (parser->flags & REGEX_ICASE)
+                add_other_case (parser, newstate, lo, hi);
+
+        parser->idx += n - 1;
+
+        return 0;
+}
+
+
+struct state *
+next_subex (struct parser *parser, struct state *prev)
+{
+        const uint8_t *regex = NULL;
+        size_t         atom = 0;
+        struct state  *newstate = NULL;
+        struct state  *subex = NULL;
+        struct state  *ret = NULL;
+        int            in_union = 0;
+
+        regex = parser->regex;
+        atom = parser->idx;
+
+        /* only for elements directly inside [ ] */
+        in_union = parser->in_union;
+        parser->in_union = 0;
+
+        switch (element_type (regex[parser->idx])) {
+
+        case SYMBOL:
+                newstate = new_start_state (parser->compiled, parser->idx);
+                newstate->ch = regex[parser->idx];
+
+                if (next_symbol (parser, newstate, in_union) != 0)
+                        return NULL;
+                ret = newstate;
+                break;
+
+        case OP_CLOSURE:
+                newstate = new_start_state (parser->compiled, parser->idx);
+                newstate->ch = regex[parser->idx];
+
+                if (!prev) {
+                        fprintf (stderr,
+                                 "RegExp is not balanced. unexpected *\n");
+                        return NULL;
+                }
+
+                /* since closure is a post-op in RegExp syntax,
+                   the manipulated node is really @prev
+                */
+                add_closure (newstate, prev);
+                return newstate;
+
+        case OP_START_UNION:
+                newstate = new_start_state (parser->compiled, parser->idx);
+                newstate->ch = regex[parser->idx];
+
+                parser->idx++;
+
+                while (parser->idx < parser->len) {
+                        if (element_type (regex[parser->idx]) == OP_STOP_UNION)
+                                break;
+
+                        parser->in_union = 1;
+                        subex = next_subex (parser, subex);
+
+                        if (!subex)
+                                return NULL;
+
+                        add_union (newstate, subex);
+                        subex = newstate;
+                        parser->idx++;
+                }
+
+                if (parser->idx >= parser->len ||
+                    element_type (regex[parser->idx]) != OP_STOP_UNION) {
+                        fprintf (stderr,
+                                 "RegExp is not balanced with a closing ]\n");
+                        return NULL;
+                }
+
+                ret = newstate;
+                break;
+
+        case OP_START_CONCAT:
+                parser->idx++;
+                while (parser->idx < parser->len) {
+                        if (element_type (regex[parser->idx]) == OP_STOP_CONCAT)
+                                break;
+
+                        subex = next_subex (parser, subex);
+
+                        if (!subex)
+                                return NULL;
+
+                        newstate = add_concat (newstate, subex);
+                        subex = newstate;
+                        parser->idx++;
+                }
+
+                if (parser->idx >= parser->len ||
+                    element_type (regex[parser->idx]) != OP_STOP_CONCAT) {
+                        fprintf (stderr, "RegExp is not balanced with a closing )\n");
+                        return NULL;
+                }
+
+                ret = newstate;
+                break;
+
+        case OP_STOP_CONCAT:
+                fprintf (stderr, "RegExp is not balanced ... unexpected ')'\n");
+                return NULL;
+
+        case OP_STOP_UNION:
+                fprintf (stderr, "RegExp is not balanced ... unexpected ']'\n");
+                return NULL;
+
+        case OP_START_REPEAT:
+                fprintf (stderr, "RegExp is not balanced ... unexpected '{'\n");
+                return NULL;
+
+        case OP_STOP_REPEAT:
+                fprintf (stderr, "RegExp is not balanced ... unexpected '}'\n");
+                return NULL;
+        }
+
+        /* peek ahead, post-ops apply to everything parsed from @atom */
+        while (ret && parser->idx + 1 < parser->len) {
+                switch (element_type (regex[parser->idx + 1])) {
+                case OP_CLOSURE:
+                        parser->idx++;
+                        ret = next_subex (parser, ret);
+                        continue;
+                case OP_START_REPEAT:
+                        parser->idx++;
+                        ret = next_repeat (parser, atom, in_union, ret);
+                        continue;
+                default:
+                        break;
+                }
+                break;
+        }
+
+        if (ret && parser->compiled->nstates > STATES_MAX) {
+                fprintf (stderr, "RegExp compiles to more than %d states\n",
+                         STATES_MAX);
+                return NULL;
+        }
+
+        return ret;
+}
+
+
+int
+leads_to_live (struct state *state, struct transition *each, void *data)
+{
+        return each->to->is_live;
+}
+
+
+int
+mark_live (struct state *state, void *data)
+{
+        int *changed = NULL;
+
+        changed = data;
+
+        if (state->is_live)
+                return 0;
+
+        if (state->is_final ||
+            transition_foreach (state, leads_to_live, NULL)) {
+                state->is_live = 1;
+                *changed = 1;
+        }
+
+        return 0;
+}
+
+
+int
+free_transitions (struct state *state)
+{
+        struct transition *trav = NULL;
+        struct transition *next = NULL;
+
+        for (trav = state->transitions; trav; trav = next) {
+                next = trav->next;
+                free (trav);
+        }
+
+        return 0;
+}
+
+
+void
+regex_free (struct regex *regex)
+{
+        struct state   *state = NULL;
+        struct counter *counter = NULL;
+
+        /* every state ever allocated, also those of a failed compile
+           or dropped by x{0} */
+        while ((state = regex->states)) {
+                regex->states = state->alloc;
+                free_transitions (state);
+                free (state);
+        }
+
+        while ((counter = regex->counters)) {
+                regex->counters = counter->next;
+                free (counter);
+        }
+
+        if (regex->literals) {
+                free (regex->literals->ends);
+                free (regex->literals->bytes);
+                free (regex->literals);
+        }
+        free (regex->required);
+        if (regex->onepass) {
+                free (regex->onepass->next);
+                free (regex->onepass->accept);
+                free (regex->onepass);
+        }
+
+        free_transitions (&regex->start);
+        free (regex->pattern);
+        free (regex);
+}
+
+
+int
+index_state (struct state *state, void *data)
+{
+        struct regex      *regex = NULL;
+        struct transition *trav = NULL;
+
+        regex = data;
+
+        state->idx = regex->nstates++;
+        regex->size += sizeof (*state);
+
+        for (trav = state->transitions; trav; trav = trav->next) {
+                trav->idx = regex->ntransitions++;
+                regex->size += sizeof (*trav);
+        }
+
+        if (state->counter) {
+                /* the counts at the pebble, and the next ones */
+                state->coff = regex->cwords;
+                regex->cwords += 2 * state->counter->words;
+        }
+
+        return 0;
+}
+
+
+int
+parse_regex (struct regex *regex, const uint8_t *pattern, size_t len)
+{
+        struct parser   parser = { .regex = pattern, .len = len,
+                                   .flags = regex->flags,
+                                   .compiled = regex };
+        struct state   *start = NULL;
+        struct state   *subex = NULL;
+        struct counter *counter = NULL;
+        int             changed = 0;
+
+        start = &regex->start;
+
+        while (parser.idx < len) {
+                subex = next_subex (&parser, start);
+                if (!subex)
+                        return -1;
+                add_concat (start, subex);
+                parser.idx++;
+        }
+
+        /* states from which no final state is reachable are dead ends,
+           the matchers give up on them early */
+        do {
+                changed = 0;
+                state_foreach (start, mark_live, &changed);
+        } while (changed);
+
+        /* number the states in use, runs keep pebbles in arrays */
+        regex->nstates = 0;
+        regex->ntransitions = 0;
+        regex->size = sizeof (*regex);
+        state_foreach (start, index_state, regex);
+
+        for (counter = regex->counters; counter; counter = counter->next) {
+                counter->toff = regex->cwords;
+                regex->cwords += counter->words;
+                regex->size += sizeof (*counter);
+        }
+
+        return 0;
+}
+
+
+/*
+ * Patterns that match only a set of literal strings, like a union of
+ * words, are also kept as that set; their DFA is then built straight
+ * from it, see dfa_literals(). The set is worked out from the pattern
+ * again once it has compiled, so it is known to be well formed.
+ */
+
+void
+literals_fini (struct literals *literals)
+{
+        free (literals->ends);
+        free (literals->bytes);
+        memset (literals, 0, sizeof (*literals));
+}
+
+
+/* the string @n of @literals, of @len bytes */
+const uint8_t *
+literal (const struct literals *literals, int n, size_t *len)
+{
+        size_t start = 0;
+
+        start = n ? literals->ends[n - 1] : 0;
+        *len = literals->ends[n] - start;
+
+        return literals->bytes + start;
+}
+
+
+/* @len more @bytes at the end of the last string */
+int
+literals_extend (struct literals *literals, const uint8_t *bytes, size_t len)
+{
+        uint8_t *more = NULL;
+        size_t   size = 0;
+
+        if (literals->len + len > LITERALS_SIZE)
+                return -1;
+
+        if (literals->len + len > literals->size) {
+                size = 2 * (literals->len + len);
+                more = realloc (literals->bytes, size);
+                if (!more)
+                        return -1;
+                literals->bytes = more;
+                literals->size = size;
+        }
+
+        if (len)
+                memcpy (literals->bytes + literals->len, bytes, len);
+        literals->len += len;
+        literals->ends[literals->count - 1] = literals->len;
+
+        return 0;
+}
+
+
+/* one more string of @len @bytes. Returns -1 past the limits */
+int
+literals_add (struct literals *literals, const uint8_t *bytes, size_t len)
+{
+        size_t *ends = NULL;
+
+        if (literals->count == LITERALS_MAX)
+                return -1;
+
+        if (!(literals->count & (literals->count - 1))) {
+                ends = realloc (literals->ends, 2 * (literals->count + 1) *
+                                sizeof (*ends));
+                if (!ends)
+                        return -1;
+                literals->ends = ends;
+        }
+
+        literals->ends[literals->count++] = literals->len;
+
+        return literals_extend (literals, bytes, len);
+}
+
+
+/* @to followed by @then: every string of one, then one of the other */
+int
+literals_concat (struct literals *to, const struct literals *then)
+{
+        struct literals  both = { 0, };
+        const uint8_t   *one = NULL;
+        const uint8_t   *two = NULL;
+        size_t           one_len = 0;
+        size_t           two_len = 0;
+        int              i = 0;
+        int              j = 0;
+        int              ret = 0;
+
+        for (i = 0; !ret && i < to->count; i++) {
+                one = literal (to, i, &one_len);
+                for (j = 0; !ret && j < then->count; j++) {
+                        two = literal (then, j, &two_len);
+                        ret = literals_add (&both, one, one_len);
+                        if (!ret)
+                                ret = literals_extend (&both, two, two_len);
+                }
+        }
+
+        literals_fini (to);
+        *to = both;
+
+        return ret;
+}
+
+
+/* @from too, as alternatives */
+int
+literals_union (struct literals *to, const struct literals *from)
+{
+        const uint8_t *one = NULL;
+        size_t         len = 0;
+        int            i = 0;
+
+        for (i = 0; i < from->count; i++) {
+                one = literal (from, i, &len);
+                if (literals_add (to, one, len) != 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+
+/* a symbol or a range of them, each as a string */
+int
+literals_symbol (struct parser *parser, struct literals *literals,
+                 int in_union)
+{
+        const uint8_t *regex = NULL;
+        uint8_t        buf[4];
+        uint32_t       lo = 0;
+        uint32_t       hi = 0;
+        uint32_t       cp = 0;
+        size_t         n = 0;
+        int            utf8 = 0;
+
+        regex = parser->regex;
+        utf8 = parser->flags & REGEX_UTF8;
+
+        if (regex[parser->idx] == '.')
+                return -1;
+
+        n = next_char (parser, parser->idx, &lo);
+        hi = lo;
+
+        if (n && in_union && parser->idx + n + 1 < parser->len &&
+            regex[parser->idx + n] == '-' &&
+            regex[parser->idx + n + 1] != '.' &&
+            element_type (regex[parser->idx + n + 1]) == SYMBOL) {
+                n += next_char (parser, parser->idx + n + 1, &hi) + 1;
+        }
+
+        /* the other case of letters past ASCII is not worked out here */
+        if (utf8 && (parser->flags & REGEX_ICASE) && hi > 0x7f)
+                return -1;
+
+        for (cp = lo; cp <= hi; cp++) {
+                if (cp >= 0xd800 && cp <= 0xdfff)
+                        continue;
+
+                if (utf8 && literals_add (literals, buf,
+                                          utf8_encode (cp, buf)) != 0)
+                        return -1;
+
+                buf[0] = cp;
+                if (!utf8 && literals_add (literals, buf, 1) != 0)
+                        return -1;
+        }
+
+        parser->idx += n - 1;
+
+        return 0;
+}
+
+
+/* like next_subex(), the strings instead of the states */
+int
+literals_subex (struct parser *parser, struct literals *literals)
+{
+        const uint8_t   *regex = NULL;
+        struct literals  one = { 0, };
+        int              in_union = 0;
+        int              ret = 0;
+
+        regex = parser->regex;
+
+        in_union = parser->in_union;
+        parser->in_union = 0;
+
+        switch (element_type (regex[parser->idx])) {
+
+        case SYMBOL:
+                ret = literals_symbol (parser, literals, in_union);
+                break;
+
+        case OP_START_UNION:
+                parser->idx++;
+                while (!ret && element_type (regex[parser->idx]) !=
+                       OP_STOP_UNION) {
+                        parser->in_union = 1;
+                        ret = literals_subex (parser, &one);
+                        if (!ret)
+                                ret = literals_union (literals, &one);
+                        literals_fini (&one);
+                        parser->idx++;
+                }
+
+                /* [] never matches, leave that to the automaton */
+                if (!literals->count)
+                        ret = -1;
+                break;
+
+        case OP_START_CONCAT:
+                parser->idx++;
+                ret = literals_add (literals, NULL, 0);
+                while (!ret && element_type (regex[parser->idx]) !=
+                       OP_STOP_CONCAT) {
+                        ret = literals_subex (parser, &one);
+                        if (!ret)
+                                ret = literals_concat (literals, &one);
+                        literals_fini (&one);
+                        parser->idx++;
+                }
+                break;
+
+        default:
+                ret = -1;
+        }
+
+        /* repeated, it is no longer a finite set of strings */
+        if (!ret && parser->idx + 1 < parser->len &&
+            (element_type (regex[parser->idx + 1]) == OP_CLOSURE ||
+             element_type (regex[parser->idx + 1]) == OP_START_REPEAT))
+                ret = -1;
+
+        return ret;
+}
+
+
+/*
+ * The strings @pattern matches, if it only matches a set of literal
+ * strings within the limits. Returns NULL if not.
+ */
+struct literals *
+regex_literals (const uint8_t *pattern, size_t len, int flags)
+{
+        struct parser    parser = { .regex = pattern, .len = len,
+                                    .flags = flags };
+        struct literals *literals = NULL;
+        struct literals  one = { 0, };
+        int              ret = 0;
+
+        literals = calloc (1, sizeof (*literals));
+        if (!literals)
+                return NULL;
+
+        ret = literals_add (literals, NULL, 0);
+        while (!ret && parser.idx < len) {
+                ret = literals_subex (&parser, &one);
+                if (!ret)
+                        ret = literals_concat (literals, &one);
+                literals_fini (&one);
+                parser.idx++;
+        }
+
+        if (ret) {
+                literals_fini (literals);
+                free (literals);
+                return NULL;
+        }
+
+        return literals;
+}
+
+
+/*
+ * A string every match contains: a chain of states, each with one
+ * byte to go on (or both cases of it with REGEX_ICASE), that every
+ * path from the start state to a final state goes through. Searches
+ * look for it first, with Horspool, and run the automaton only around
+ * where it occurs. Found on the compiled states, bounded in size.
+ */
+
+struct analysis {
+        struct regex      *regex;
+        struct state     **states;      /* by idx */
+        int               *stack;
+        int               *seen;        /* == mark when seen */
+        int                mark;
+        char              *color;       /* path_max(): 1 open, 2 done */
+        long              *longest;
+        int                unbounded;
+        struct state      *goal;        /* NULL for any final state */
+        uint8_t            fold[256];
+};
+
+
+int
+index_by_idx (struct state *state, void *data)
+{
+        struct analysis *analysis = NULL;
+
+        analysis = data;
+        analysis->states[state->idx] = state;
+
+        return 0;
+}
+
+
+/*
+ * The byte @state goes on with, if it only has the one (folded) and
+ * is not final. Returns -1 if not.
+ */
+int
+required_byte (struct analysis *analysis, struct state *state)
+{
+        struct transition *trav = NULL;
+        int                byte = -1;
+
+        if (state->is_final)
+                return -1;
+
+        for (trav = state->transitions; trav; trav = trav->next) {
+                if (!trav->to->is_live)
+                        continue;
+                if (trav->label >= 256)
+                        return -1;
+                if (byte >= 0 && analysis->fold[trav->label] != byte)
+                        return -1;
+                byte = analysis->fold[trav->label];
+        }
+
+        return byte;
+}
+
+
+/*
+ * The state a pebble on @state necessarily goes on from after its
+ * byte: the only one in reach by E transitions that takes a byte, if
+ * no final state is in reach. NULL if there is no such state.
+ */
+struct state *
+required_next (struct analysis *analysis, struct state *state)
+{
+        struct transition *trav = NULL;
+        struct state      *next = NULL;
+        struct state      *each = NULL;
+        int                depth = 0;
+        int                takes = 0;
+
+        analysis->mark++;
+
+        for (trav = state->transitions; trav; trav = trav->next) {
+                if (trav->to->is_live &&
+                    analysis->seen[trav->to->idx] != analysis->mark) {
+                        analysis->seen[trav->to->idx] = analysis->mark;
+                        analysis->stack[depth++] = trav->to->idx;
+                }
+        }
+
+        while (depth) {
+                each = analysis->states[analysis->stack[--depth]];
+                if (each->is_final)
+                        return NULL;
+
+                takes = 0;
+                for (trav = each->transitions; trav; trav = trav->next) {
+                        if (!trav->to->is_live)
+                                continue;
+                        if (!is_E (trav->label)) {
+                                takes = 1;
+                                continue;
+                        }
+                        if (analysis->seen[trav->to->idx] != analysis->mark) {
+                                analysis->seen[trav->to->idx] = analysis->mark;
+                                analysis->stack[depth++] = trav->to->idx;
+                        }
+                }
+
+                if (takes && next)
+                        return NULL;
+                if (takes)
+                        next = each;
+        }
+
+        return next;
+}
+
+
+/* do all paths from the start state to a final one go through @state? */
+int
+required_state (struct analysis *analysis, struct state *state)
+{
+        struct transition *trav = NULL;
+        struct state      *each = NULL;
+        int                depth = 0;
+
+        analysis->mark++;
+        analysis->seen[analysis->regex->start.idx] = analysis->mark;
+        analysis->stack[depth++] = analysis->regex->start.idx;
+
+        while (depth) {
+                each = analysis->states[analysis->stack[--depth]];
+                if (each->is_final)
+                        return 0;
+
+                for (trav = each->transitions; trav; trav = trav->next) {
+                        if (trav->to == state || !trav->to->is_live ||
+                            analysis->seen[trav->to->idx] == analysis->mark)
+                                continue;
+                        analysis->seen[trav->to->idx] = analysis->mark;
+                        analysis->stack[depth++] = trav->to->idx;
+                }
+        }
+
+        return 1;
+}
+
+
+/*
+ * The most bytes read on a path from @state to analysis->goal, -1 if
+ * there is none. Sets analysis->unbounded on a cycle.
+ */
+long
+path_max (struct analysis *analysis, struct state *state)
+{
+        struct transition *trav = NULL;
+        long               best = -1;
+        long               ret = 0;
+
+        if (state == analysis->goal)
+                return 0;
+
+        if (analysis->color[state->idx] == 2)
+                return analysis->longest[state->idx];
+
+        if (analysis->color[state->idx] == 1) {
+                analysis->unbounded = 1;
+                return -1;
+        }
+
+        analysis->color[state->idx] = 1;
+
+        if (!analysis->goal && state->is_final)
+                best = 0;
+
+        for (trav = state->transitions; trav; trav = trav->next) {
+                if (!trav->to->is_live)
+                        continue;
+
+                ret = path_max (analysis, trav->to);
+                if (ret >= 0 && ret + !is_E (trav->label) > best)
+                        best = ret + !is_E (trav->label);
+        }
+
+        analysis->color[state->idx] = 2;
+        analysis->longest[state->idx] = best;
+
+        return best;
+}
+
+
+/*
+ * The longest chain of required bytes from @state into @bytes, with
+ * the state it ends on in @last. Returns its length.
+ */
+size_t
+required_chain (struct analysis *analysis, struct state *state,
+                uint8_t *bytes, struct state **last)
+{
+        size_t len = 0;
+        int    byte = 0;
+
+        while (len < REQUIRED_MAX &&
+               (byte = required_byte (analysis, state)) >= 0) {
+                bytes[len++] = byte;
+                *last = state;
+
+                state = required_next (analysis, state);
+                if (!state)
+                        break;
+        }
+
+        return len;
+}
+
+
+/* the longest path the rest of a match can take after @last's byte */
+long
+required_after (struct analysis *analysis, struct state *last)
+{
+        struct transition *trav = NULL;
+        long               best = 0;
+        long               ret = 0;
+
+        analysis->goal = NULL;
+        analysis->unbounded = 0;
+        memset (analysis->color, 0, analysis->regex->nstates);
+
+        for (trav = last->transitions; trav; trav = trav->next) {
+                if (!trav->to->is_live)
+                        continue;
+
+                ret = path_max (analysis, trav->to);
+                if (ret > best)
+                        best = ret;
+        }
+
+        return analysis->unbounded ? -1 : best;
+}
+
+
+/* is the state @to in reach of @from by E transitions only? */
+int
+E_reaches (struct analysis *analysis, struct state *from, struct state *to)
+{
+        struct transition *trav = NULL;
+        struct state      *each = NULL;
+        int                depth = 0;
+
+        analysis->mark++;
+        analysis->seen[from->idx] = analysis->mark;
+        analysis->stack[depth++] = from->idx;
+
+        while (depth) {
+                each = analysis->states[analysis->stack[--depth]];
+                if (each == to || (!to && each->is_final))
+                        return 1;
+
+                for (trav = each->transitions; trav; trav = trav->next) {
+                        if (trav->label != E ||
+                            analysis->seen[trav->to->idx] == analysis->mark)
+                                continue;
+                        analysis->seen[trav->to->idx] = analysis->mark;
+                        analysis->stack[depth++] = trav->to->idx;
+                }
+        }
+
+        return 0;
+}
+
+
+/* NULL @to is any final state, in reach of all the targets of @from */
+int
+E_reaches_after (struct analysis *analysis, struct state *from)
+{
+        struct transition *trav = NULL;
+
+        for (trav = from->transitions; trav; trav = trav->next) {
+                if (trav->to->is_live && E_reaches (analysis, trav->to, NULL))
+                        return 1;
+        }
+
+        return 0;
+}
+
+
+void
+required_skip (struct required *required)
+{
+        size_t k = 0;
+        size_t j = 0;
+        int    c = 0;
+
+        k = required->len;
+
+        for (c = 0; c < 256; c++) {
+                required->skip[c] = k;
+                for (j = 0; j + 1 < k; j++) {
+                        if (required->fold[c] == required->bytes[j])
+                                required->skip[c] = k - 1 - j;
+                }
+        }
+}
+
+
+/*
+ * The longest string of at least REQUIRED_MIN bytes all matches of
+ * @regex contain, if there is one. Returns NULL if not.
+ */
+struct required *
+regex_required (struct regex *regex)
+{
+        struct analysis  analysis = { .regex = regex };
+        struct required *required = NULL;
+        struct state    *state = NULL;
+        struct state    *last = NULL;
+        struct state    *best_first = NULL;
+        struct state    *best_last = NULL;
+        uint8_t          bytes[REQUIRED_MAX];
+        size_t           len = 0;
+        size_t           best = REQUIRED_MIN - 1;
+        int              n = 0;
+        int              c = 0;
+
+        if (regex->nstates > REQUIRED_STATES_MAX)
+                return NULL;
+
+        for (c = 0; c < 256; c++) {
+                analysis.fold[c] = c;
+                if ((regex->flags & REGEX_ICASE) && c >= 'A' && c <= 'Z')
+                        analysis.fold[c] = c + 'a' - 'A';
+        }
+
+        required = calloc (1, sizeof (*required));
+        analysis.states = calloc (regex->nstates, sizeof (*analysis.states));
+        analysis.stack = calloc (regex->nstates, sizeof (*analysis.stack));
+        analysis.seen = calloc (regex->nstates, sizeof (*analysis.seen));
+        analysis.color = calloc (regex->nstates, 1);
+        analysis.longest = calloc (regex->nstates, sizeof (long));
+        if (!required || !analysis.states || !analysis.stack ||
+            !analysis.seen || !analysis.color || !analysis.longest)
+                goto out;
+
+        state_foreach (&regex->start, index_by_idx, &analysis);
+
+        for (n = 0; n < regex->nstates; n++) {
+                state = analysis.states[n];
+                if (!state->is_live)
+                        continue;
+
+                len = required_chain (&analysis, state, bytes, &last);
+                if (len > best && required_state (&analysis, state)) {
+                        best = len;
+                        best_first = state;
+                        best_last = last;
+                        memcpy (required->bytes, bytes, len);
+                }
+        }
+
+        if (!best_first)
+                goto out;
+
+        required->len = best;
+        memcpy (required->fold, analysis.fold, sizeof (required->fold));
+        required_skip (required);
+
+        analysis.goal = best_first;
+        analysis.unbounded = 0;
+        required->before = path_max (&analysis, &regex->start);
+        if (analysis.unbounded)
+                required->before = -1;
+        required->after = required_after (&analysis, best_last);
+
+        /* with no counters every E transition can be taken */
+        required->always = !regex->counters &&
+                E_reaches (&analysis, &regex->start, best_first) &&
+                E_reaches_after (&analysis, best_last);
+
+        free (analysis.states);
+        free (analysis.stack);
+        free (analysis.seen);
+        free (analysis.color);
+        free (analysis.longest);
+
+        return required;
+
+out:
+        free (required);
+        free (analysis.states);
+        free (analysis.stack);
+        free (analysis.seen);
+        free (analysis.color);
+        free (analysis.longest);
+
+        return NULL;
+}
+
+
+/*
+ * One-pass RegExps: those where, with E transitions followed, no byte
+ * can go on to two different states. Matching one only ever has one
+ * state to be in, so it is a table lookup per byte, by position: the
+ * start state and the targets of transitions that read a byte, each
+ * with its E closure worked out here. Position ONEPASS_DEAD is no
+ * state, it is where bytes nothing reads lead.
+ */
+
+#define ONEPASS_DEAD      0
+#define ONEPASS_START     1
+
+
+/*
+ * The one-pass table of @regex, if it has no counted repetitions and
+ * is one-pass within ONEPASS_MAX positions. Returns NULL if not.
+ */
+struct onepass *
+regex_onepass (struct regex *regex)
+{
+        struct analysis    analysis = { .regex = regex };
+        struct onepass    *onepass = NULL;
+        struct transition *trav = NULL;
+        struct state      *each = NULL;
+        int               *position = NULL;     /* by idx, 0 if none */
+        int               *at = NULL;           /* by position, its idx */
+        int               *next = NULL;
+        int                depth = 0;
+        int                p = 0;
+        int                q = 0;
+        int                n = 0;
+        int                c = 0;
+
+        if (regex->counters || regex->nstates > REQUIRED_STATES_MAX)
+                return NULL;
+
+        onepass = calloc (1, sizeof (*onepass));
+        analysis.states = calloc (regex->nstates, sizeof (*analysis.states));
+        analysis.stack = calloc (regex->nstates, sizeof (*analysis.stack));
+        analysis.seen = calloc (regex->nstates, sizeof (*analysis.seen));
+        position = calloc (regex->nstates, sizeof (*position));
+        at = calloc (regex->nstates + ONEPASS_START, sizeof (*at));
+        if (!onepass || !analysis.states || !analysis.stack ||
+            !analysis.seen || !position || !at)
+                goto out;
+
+        state_foreach (&regex->start, index_by_idx, &analysis);
+
+        onepass->npositions = ONEPASS_START;
+        position[regex->start.idx] = onepass->npositions;
+        at[onepass->npositions++] = regex->start.idx;
+
+        for (n = 0; n < regex->nstates; n++) {
+                for (trav = analysis.states[n]->transitions; trav;
+                     trav = trav->next) {
+                        if (is_E (trav->label) || !trav->to->is_live ||
+                            position[trav->to->idx])
+                                continue;
+                        position[trav->to->idx] = onepass->npositions;
+                        at[onepass->npositions++] = trav->to->idx;
+                }
+        }
+
+        if (onepass->npositions > ONEPASS_MAX)
+                goto out;
+
+        onepass->next = calloc ((size_t) onepass->npositions * 256,
+                                sizeof (*onepass->next));
+        onepass->accept = calloc (onepass->npositions, 1);
+        if (!onepass->next || !onepass->accept)
+                goto out;
+
+        for (p = ONEPASS_START; p < onepass->npositions; p++) {
+                next = onepass->next + (size_t) p * 256;
+
+                analysis.mark++;
+                analysis.seen[at[p]] = analysis.mark;
+                analysis.stack[depth++] = at[p];
+
+                while (depth) {
+                        each = analysis.states[analysis.stack[--depth]];
+                        if (each->is_final)
+                                onepass->accept[p] = 1;
+
+                        for (trav = each->transitions; trav;
+                             trav = trav->next) {
+                                if (!trav->to->is_live)
+                                        continue;
+
+                                if (is_E (trav->label)) {
+                                        if (analysis.seen[trav->to->idx] ==
+                                            analysis.mark)
+                                                continue;
+                                        analysis.seen[trav->to->idx] =
+                                                analysis.mark;
+                                        analysis.stack[depth++] =
+                                                trav->to->idx;
+                                        continue;
+                                }
+
+                                q = position[trav->to->idx];
+                                for (c = 0; c < 256; c++) {
+                                        if (!transition_matches (trav, c))
+                                                continue;
+                                        if (next[c] && next[c] != q)
+                                                goto out;
+                                        next[c] = q;
+                                }
+                        }
+                }
+        }
+
+        free (analysis.states);
+        free (analysis.stack);
+        free (analysis.seen);
+        free (position);
+        free (at);
+
+        return onepass;
+
+out:
+        if (onepass) {
+                free (onepass->next);
+                free (onepass->accept);
+                free (onepass);
+        }
+        free (analysis.states);
+        free (analysis.stack);
+        free (analysis.seen);
+        free (position);
+        free (at);
+
+        return NULL;
+}
+
+
+/*
+ * Compile @len bytes of @pattern. The result holds one reference,
+ * drop it with regex_unref().
+ */
+struct regex *
+regex_compile (const uint8_t *pattern, size_t len, int flags)
+{
+        struct regex *regex = NULL;
+
+        regex = calloc (1, sizeof (*regex));
+        if (!regex)
+                return NULL;
+
+        /* Hardcoded start state, to kick-start */
+        regex->start.next = &regex->start;
+        regex->start.prev = &regex->start;
+        regex->start.is_start = 1;
+        regex->start.is_final = 1;
+
+        regex->flags = flags;
+        regex->refs = 1;
+
+        if (parse_regex (regex, pattern, len) != 0) {
+                regex_free (regex);
+                return NULL;
+        }
+
+        regex->literals = regex_literals (pattern, len, flags);
+        if (regex->literals)
+                regex->size += sizeof (*regex->literals) +
+                        regex->literals->count * sizeof (size_t) +
+                        regex->literals->len;
+
+        regex->required = regex_required (regex);
+        if (regex->required)
+                regex->size += sizeof (*regex->required);
+
+        regex->onepass = regex_onepass (regex);
+        if (regex->onepass)
+                regex->size += sizeof (*regex->onepass) +
+                        regex->onepass->npositions * (256 * sizeof (int) + 1);
+
+        return regex;
+}
+
+
+struct regex *
+regex_ref (struct regex *regex)
+{
+        __atomic_add_fetch (&regex->refs, 1, __ATOMIC_RELAXED);
+
+        return regex;
+}
+
+
+void
+regex_unref (struct regex *regex)
+{
+        if (__atomic_sub_fetch (&regex->refs, 1, __ATOMIC_ACQ_REL) == 0)
+                regex_free (regex);
+}
+
+
+/*
+ * Cache of compiled RegExps, keyed by the pattern bytes and flags.
+ * It holds a reference to each regex it has; when over @max_size
+ * bytes the least recently used ones are dropped from it, and freed
+ * once their last user lets go.
+ */
+
+#define REGEX_CACHE_SIZE  (16 << 20)  /* default bytes of a cache, -C */
+
+struct regex_cache {
+        pthread_mutex_t    lock;
+        struct regex     **buckets;
+        size_t             nbuckets;
+        struct regex      *lru_head;    /* most recently used */
+        struct regex      *lru_tail;
+        size_t             size;
+        size_t             max_size;
+        size_t             entries;
+
+        unsigned long      hits;
+        unsigned long      misses;
+        unsigned long      evictions;
+};
+
+
+struct regex_cache_stats {
+        unsigned long      hits;
+        unsigned long      misses;
+        unsigned long      evictions;
+        size_t             entries;
+        size_t             size;        /* bytes held */
+};
+
+
+struct regex_cache *
+regex_cache_new (size_t max_size)
+{
+        struct regex_cache *cache = NULL;
+
+        cache = calloc (1, sizeof (*cache));
+        if (!cache)
+                return NULL;
+
+        cache->nbuckets = 256;
+        cache->buckets = calloc (cache->nbuckets, sizeof (*cache->buckets));
+        if (!cache->buckets) {
+                free (cache);
+                return NULL;
+        }
+
+        cache->max_size = max_size;
+        pthread_mutex_init (&cache->lock, NULL);
+
+        return cache;
+}
+
+
+uint64_t
+cache_hash (const uint8_t *pattern, size_t len, int flags)
+{
+        uint64_t hash = 0xcbf29ce484222325ULL; /* FNV-1a */
+        size_t   i = 0;
+
+        for (i = 0; i < len; i++) {
+                hash ^= pattern[i];
+                hash *= 0x100000001b3ULL;
+        }
+
+        hash ^= flags;
+        hash *= 0x100000001b3ULL;
+
+        return hash;
+}
+
+
+void
+lru_unlink (struct regex_cache *cache, struct regex *regex)
+{
+        if (regex->lru_prev)
+                regex->lru_prev->lru_next = regex->lru_next;
+        else
+                cache->lru_head = regex->lru_next;
+
+        if (regex->lru_next)
+                regex->lru_next->lru_prev = regex->lru_prev;
+        else
+                cache->lru_tail = regex->lru_prev;
+
+        regex->lru_prev = NULL;
+        regex->lru_next = NULL;
+}
+
+
+void
+lru_push (struct regex_cache *cache, struct regex *regex)
+{
+        regex->lru_prev = NULL;
+        regex->lru_next = cache->lru_head;
+
+        if (cache->lru_head)
+                cache->lru_head->lru_prev = regex;
+        else
+                cache->lru_tail = regex;
+
+        cache->lru_head = regex;
+}
+
+
+struct regex *
+cache_lookup (struct regex_cache *cache, const uint8_t *pattern, size_t len,
+              int flags, uint64_t hash)
+{
+        struct regex *trav = NULL;
+
+        trav = cache->buckets[hash % cache->nbuckets];
+
+        for (; trav; trav = trav->hash_next) {
+                if (trav->hash == hash && trav->flags == flags &&
+                    trav->len == len && !memcmp (trav->pattern, pattern, len))
+                        break;
+        }
+
+        return trav;
+}
+
+
+void
+cache_evict (struct regex_cache *cache, struct regex *regex)
+{
+        struct regex **trav = NULL;
+
+        trav = &cache->buckets[regex->hash % cache->nbuckets];
+        while (*trav != regex)
+                trav = &(*trav)->hash_next;
+        *trav = regex->hash_next;
+        regex->hash_next = NULL;
+
+        lru_unlink (cache, regex);
+
+        cache->size -= regex->size;
+        cache->entries--;
+        cache->evictions++;
+
+        regex_unref (regex);
+}
+
+
+void
+cache_grow (struct regex_cache *cache)
+{
+        struct regex **buckets = NULL;
+        struct regex  *trav = NULL;
+        struct regex  *next = NULL;
+        size_t         nbuckets = 0;
+        size_t         i = 0;
+
+        nbuckets = cache->nbuckets * 2;
+        buckets = calloc (nbuckets, sizeof (*buckets));
+        if (!buckets)
+                return; /* longer chains, still works */
+
+        for (i = 0; i < cache->nbuckets; i++) {
+                for (trav = cache->buckets[i]; trav; trav = next) {
+                        next = trav->hash_next;
+                        trav->hash_next = buckets[trav->hash % nbuckets];
+                        buckets[trav->hash % nbuckets] = trav;
+                }
+        }
+
+        free (cache->buckets);
+        cache->buckets = buckets;
+        cache->nbuckets = nbuckets;
+}
+
+
+/*
+ * Get the compiled form of @pattern, compiling it on a miss. Returns a
+ * new reference to a shared regex that must not be modified, or NULL
+ * if @pattern does not compile.
+ */
+struct regex *
+regex_cache_get (struct regex_cache *cache, const uint8_t *pattern,
+                 size_t len, int flags)
+{
+        struct regex *regex = NULL;
+        struct regex *found = NULL;
+        uint64_t      hash = 0;
+
+        hash = cache_hash (pattern, len, flags);
+
+        pthread_mutex_lock (&cache->lock);
+        {
+                regex = cache_lookup (cache, pattern, len, flags, hash);
+                if (regex) {
+                        cache->hits++;
+                        lru_unlink (cache, regex);
+                        lru_push (cache, regex);
+                        regex_ref (regex);
+                } else {
+                        cache->misses++;
+                }
+        }
+        pthread_mutex_unlock (&cache->lock);
+
+        if (regex)
+                return regex;
+
+        /* compile without the lock, others may hit meanwhile */
+        regex = regex_compile (pattern, len, flags);
+        if (!regex)
+                return NULL;
+
+        regex->hash = hash;
+        regex->len = len;
+        regex->pattern = malloc (len ? len : 1);
+        if (!regex->pattern)
+                return regex; /* works, just not cached */
+        memcpy (regex->pattern, pattern, len);
+        regex->size += len;
+
+        if (regex->size > cache->max_size)
+                return regex; /* would evict everything else */
+
+        pthread_mutex_lock (&cache->lock);
+        {
+                found = cache_lookup (cache, pattern, len, flags, hash);
+                if (found) {
+                        /* lost a race compiling the same pattern */
+                        regex_ref (found);
+                } else {
+                        while (cache->size + regex->size > cache->max_size)
+                                cache_evict (cache, cache->lru_tail);
+
+                        if (cache->entries >= cache->nbuckets)
+                                cache_grow (cache);
+
+                        regex->hash_next =
+                                cache->buckets[hash % cache->nbuckets];
+                        cache->buckets[hash % cache->nbuckets] = regex;
+                        lru_push (cache, regex);
+                        cache->size += regex->size;
+                        cache->entries++;
+
+                        regex_ref (regex); /* the cache's */
+                }
+        }
+        pthread_mutex_unlock (&cache->lock);
+
+        if (found) {
+                regex_unref (regex);
+                return found;
+        }
+
+        return regex;
+}
+
+
+void
+regex_cache_stats (struct regex_cache *cache, struct regex_cache_stats *stats)
+{
+        pthread_mutex_lock (&cache->lock);
+        {
+                stats->hits = cache->hits;
+                stats->misses = cache->misses;
+                stats->evictions = cache->evictions;
+                stats->entries = cache->entries;
+                stats->size = cache->size;
+        }
+        pthread_mutex_unlock (&cache->lock);
+}
+
+
+void
+regex_cache_destroy (struct regex_cache *cache)
+{
+        while (cache->lru_tail)
+                cache_evict (cache, cache->lru_tail);
+
+        pthread_mutex_destroy (&cache->lock);
+        free (cache->buckets);
+        free (cache);
+}
+
+
+/*
+ * How often a run used each state and transition of its regex, to see
+ * where the work goes. Counted only when a run is given one.
+ */
+struct profile {
+        unsigned long   *states;        /* pebbles placed, per state->idx */
+        unsigned long   *transitions;   /* followed, per transition->idx */
+};
+
+
+/*
+ * Everything a match changes. Pebbles are kept by state index so that
+ * the regex itself stays read-only.
+ */
+struct run {
+        struct regex    *regex;
+        char            *pebble;        /* is placed */
+        char            *next_pebble;   /* is placed */
+        uint64_t        *counts;        /* sets of counts, see state->coff */
+        int              placed;        /* pebbles placed by the last move */
+
+        match_mode_t     mode;
+        int              search;        /* match anywhere */
+        size_t           pos;           /* input bytes fed so far */
+        size_t           end;           /* of the match found */
+        int              ret;           /* 1 found, or a MATCH_ERR_ */
+        int              done;          /* no more input needed */
+        unsigned long    cost;          /* steps per input byte */
+        unsigned long    steps;
+        unsigned long    max_steps;
+        struct profile  *profile;       /* NULL unless profiling */
+};
+
+
+size_t
+run_size (struct regex *regex)
+{
+        return (2 * regex->nstates +
+                (regex->cwords + 1) * sizeof (uint64_t));
+}
+
+
+int
+run_init (struct run *run, struct regex *regex)
+{
+        run->regex = regex;
+        run->placed = 0;
+        run->profile = NULL;
+
+        run->pebble = calloc (2 * regex->nstates, 1);
+        run->counts = calloc (regex->cwords + 1, sizeof (uint64_t));
+
+        if (!run->pebble || !run->counts) {
+                free (run->pebble);
+                free (run->counts);
+                return -1;
+        }
+
+        run->next_pebble = run->pebble + regex->nstates;
+
+        return 0;
+}
+
+
+void
+run_fini (struct run *run)
+{
+        free (run->pebble);
+        free (run->counts);
+}
+
+
+struct profile *
+profile_new (struct regex *regex)
+{
+        struct profile *profile = NULL;
+
+        profile = calloc (1, sizeof (*profile));
+        if (!profile)
+                return NULL;
+
+        profile->states = calloc (regex->nstates + 1,
+                                  sizeof (*profile->states));
+        profile->transitions = calloc (regex->ntransitions + 1,
+                                       sizeof (*profile->transitions));
+        if (!profile->states || !profile->transitions) {
+                free (profile->states);
+                free (profile->transitions);
+                free (profile);
+                return NULL;
+        }
+
+        return profile;
+}
+
+
+void
+profile_free (struct profile *profile)
+{
+        free (profile->states);
+        free (profile->transitions);
+        free (profile);
+}
+
+
+/* @trans is followed by a pebble of @run */
+void
+profile_transition (struct run *run, struct transition *trans)
+{
+        if (run->profile)
+                run->profile->transitions[trans->idx]++;
+}
+
+
+int
+counts_merge (uint64_t *to, const uint64_t *from, int words)
+{
+        int i = 0;
+        int changed = 0;
+
+        for (i = 0; i < words; i++) {
+                if (from[i] & ~to[i]) {
+                        to[i] |= from[i];
+                        changed = 1;
+                }
+        }
+
+        return changed;
+}
+
+
+int
+counts_reach (const uint64_t *counts, int min, int words)
+{
+        int i = 0;
+
+        /* any count >= min? */
+        if (counts[min / 64] & (~0ULL << (min % 64)))
+                return 1;
+
+        for (i = (min / 64) + 1; i < words; i++) {
+                if (counts[i])
+                        return 1;
+        }
+
+        return 0;
+}
+
+
+struct placing {
+        struct run      *run;
+        const uint64_t  *counts;        /* what the pebble carries */
+};
+
+
+int place_pebble (struct run *run, struct state *state,
+                  const uint64_t *counts);
+
+int
+place_pebble_if_E_transition (struct state *state, struct transition *each,
+                              void *data)
+{
+        struct placing *placing = NULL;
+        struct counter *counter = NULL;
+        uint64_t       *tmp = NULL;
+        int             i = 0;
+
+        placing = data;
+
+        switch (each->label) {
+        case E:
+                profile_transition (placing->run, each);
+                place_pebble (placing->run, each->to, placing->counts);
+                break;
+
+        case E_ENTER:
+                counter = each->to->counter;
+                tmp = placing->run->counts + counter->toff;
+                memset (tmp, 0, counter->words * sizeof (uint64_t));
+                tmp[0] = 1;
+                profile_transition (placing->run, each);
+                place_pebble (placing->run, each->to, tmp);
+                break;
+
+        case E_BODY:
+                counter = state->counter;
+                tmp = placing->run->counts + counter->toff;
+                memcpy (tmp, placing->counts,
+                        counter->words * sizeof (uint64_t));
+                tmp[counter->max / 64] &= ~(1ULL << (counter->max % 64));
+                if (counts_reach (tmp, 0, counter->words)) {
+                        profile_transition (placing->run, each);
+                        place_pebble (placing->run, each->to, tmp);
+                }
+                break;
+
+        case E_AGAIN:
+                /* counts in the body are all < max, no carry past max */
+                counter = state->counter;
+                tmp = placing->run->counts + counter->toff;
+                for (i = counter->words - 1; i > 0; i--)
+                        tmp[i] = (placing->counts[i] << 1) |
+                                (placing->counts[i - 1] >> 63);
+                tmp[0] = placing->counts[0] << 1;
+                profile_transition (placing->run, each);
+                place_pebble (placing->run, each->to, tmp);
+                break;
+
+        case E_EXIT:
+                counter = state->counter;
+                if (counts_reach (placing->counts, counter->min,
+                                  counter->words)) {
+                        profile_transition (placing->run, each);
+                        place_pebble (placing->run, each->to, NULL);
+                }
+                break;
+        }
+
+        return 0;
+}
+
+int
+place_pebble (struct run *run, struct state *state, const uint64_t *counts)
+{
+        struct placing placing = { .run = run, .counts = counts };
+        uint64_t      *next_counts = NULL;
+
+        if (!state->is_live)
+                return 0;
+
+        if (state->counter) {
+                /* placed again only if it brings new counts along */
+                next_counts = run->counts + state->coff +
+                        state->counter->words;
+                if (!counts_merge (next_counts, counts,
+                                   state->counter->words))
+                        return 0;
+                placing.counts = next_counts;
+        } else if (run->next_pebble[state->idx]) {
+                return 0;
+        }
+
+        run->next_pebble[state->idx] = 1;
+        if (run->profile)
+                run->profile->states[state->idx]++;
+
+        transition_foreach (state, place_pebble_if_E_transition, &placing);
+
+        return 0;
+}
+
+
+struct moving {
+        struct run      *run;
+        uint8_t          byte;
+};
+
+
+int
+attempt_move (struct state *state, struct transition *each,
+              void *data)
+{
+        struct moving  *moving = NULL;
+        const uint64_t *counts = NULL;
+
+        moving = data;
+
+        if (state->counter)
+                counts = moving->run->counts + state->coff;
+
+        /* try them all, UTF-8 paths can share their first byte */
+        if (transition_matches (each, moving->byte)) {
+                profile_transition (moving->run, each);
+                place_pebble (moving->run, each->to, counts);
+                if (state->E_source)
+                        moving->run->pebble[state->idx] = 1;
+        }
+
+        return 0;
+}
+
+
+int
+move_pebble (struct state *state, void *data)
+{
+        struct moving *moving = NULL;
+
+        moving = data;
+
+        if (!moving->run->pebble[state->idx])
+                return 0;
+
+        moving->run->pebble[state->idx] = 0;
+                           /* Guilty until proven innocent -
+                              attempt_move will set this pebble
+                              back if it is a source of any E
+                              transitions, and if it has a non-E
+                              transition for this input */
+        transition_foreach (state, attempt_move, data);
+
+        return 0;
+}
+
+
+
+int
+place_pebble_if_start (struct state *state, void *data)
+{
+        if (state->is_start)
+                place_pebble (data, state, NULL);
+
+        return 0;
+}
+
+
+int
+pebble_in_final (struct state *state, void *data)
+{
+        struct run *run = NULL;
+
+        run = data;
+
+        if (run->pebble[state->idx] && state->is_final)
+                return 1;
+
+        return 0;
+}
+
+
+int
+commit_pebble (struct state *state, void *data)
+{
+        struct run *run = NULL;
+        uint64_t   *counts = NULL;
+        int         words = 0;
+
+        run = data;
+
+        if (run->next_pebble[state->idx]) {
+                run->pebble[state->idx] = 1;
+                run->next_pebble[state->idx] = 0;
+                run->placed++;
+
+                if (state->counter) {
+                        counts = run->counts + state->coff;
+                        words = state->counter->words;
+                        memcpy (counts, counts + words,
+                                words * sizeof (uint64_t));
+                        memset (counts + words, 0,
+                                words * sizeof (uint64_t));
+                }
+        }
+
+        return 0;
+}
+
+
+const char *
+match_strerror (int err)
+{
+        switch (err) {
+        case MATCH_ERR_NOMEM:  return "out of memory";
+        case MATCH_ERR_STEPS:  return "too many steps";
+        case MATCH_ERR_MEMORY: return "too much memory";
+        case MATCH_ERR_STATES: return "too many states";
+        case MATCH_ERR_READ:   return "could not read the input";
+        }
+
+        return "no error";
+}
+
+
+void
+run_reset (struct run *run)
+{
+        memset (run->pebble, 0, 2 * run->regex->nstates);
+        memset (run->counts, 0,
+                (run->regex->cwords + 1) * sizeof (uint64_t));
+}
+
+
+/*
+ * Start matching in @mode, with @search anywhere in the input, within
+ * @limits (may be NULL). The input is then given to run_feed(), in as
+ * many pieces as it comes in, and the answer taken from run_end().
+ *
+ * Every input byte costs as many steps as there are states and words
+ * of counts, checked before it is looked at, so that the budget is
+ * known to run out before any work is done past it.
+ */
+void
+run_begin (struct run *run, match_mode_t mode, int search,
+           const struct match_limits *limits)
+{
+        struct regex *regex = NULL;
+
+        regex = run->regex;
+
+        run->mode = mode;
+        run->search = search;
+        run->pos = 0;
+        run->end = 0;
+        run->ret = 0;
+        run->done = 0;
+        run->placed = 0;
+        run->cost = regex->nstates + regex->cwords;
+        run->steps = run->cost;
+        run->max_steps = limits ? limits->max_steps : 0;
+
+        if (run->max_steps && run->steps > run->max_steps) {
+                run->ret = MATCH_ERR_STEPS;
+                run->done = 1;
+                return;
+        }
+
+        run_reset (run);
+        state_foreach (&regex->start, place_pebble_if_start, run);
+        state_foreach (&regex->start, commit_pebble, run);
+}
+
+
+/*
+ * Feed the next @len bytes of input to @run. Returns 1 once no more
+ * input can change the answer, 0 while it can. Gives up as soon as no
+ * pebble is left on a state from which a final state can be reached.
+ */
+int
+run_feed (struct run *run, const uint8_t *buf, size_t len)
+{
+        struct state  *state = NULL;
+        struct moving  moving = { .run = run };
+        size_t         i = 0;
+
+        state = &run->regex->start;
+
+        for (i = 0; !run->done; i++) {
+                if (run->mode != MATCH_FULL &&
+                    state_foreach (state, pebble_in_final, run)) {
+                        run->ret = 1;
+                        run->end = run->pos;
+                        if (run->mode != MATCH_LONGEST) {
+                                run->done = 1;
+                                break;
+                        }
+                }
+
+                if (run->placed == 0) {
+                        run->done = 1;
+                        break;
+                }
+
+                if (i == len)
+                        break;
+
+                run->steps += run->cost;
+                if (run->max_steps && run->steps > run->max_steps) {
+                        run->ret = MATCH_ERR_STEPS;
+                        run->done = 1;
+                        break;
+                }
+
+                run->placed = 0;
+                moving.byte = buf[i];
+                state_foreach (state, move_pebble, &moving);
+                if (run->search) /* a match may also start after it */
+                        state_foreach (state, place_pebble_if_start, run);
+                state_foreach (state, commit_pebble, run);
+                run->pos++;
+        }
+
+        return run->done;
+}
+
+
+/*
+ * The end of the input. Returns 1 if it was accepted, with the length
+ * of the accepted prefix in @end, 0 if not, or a MATCH_ERR_.
+ */
+int
+run_end (struct run *run, size_t *end)
+{
+        if (!run->done) /* the end may not have been looked at yet */
+                run_feed (run, NULL, 0);
+
+        if (run->mode == MATCH_FULL && run->ret == 0) {
+                run->ret = state_foreach (&run->regex->start,
+                                          pebble_in_final, run);
+                run->end = run->pos;
+        }
+
+        if (run->ret == 1)
+                *end = run->end;
+
+        return run->ret;
+}
+
+
+/*
+ * Run @buf through @regex. Returns 1 if it is accepted in @mode, with
+ * the length of the accepted prefix in @end, 0 if not, or a MATCH_ERR_
+ * if it went over @limits (may be NULL).
+ */
+int
+match_regex (struct regex *regex, const uint8_t *buf, size_t len,
+             match_mode_t mode, const struct match_limits *limits,
+             size_t *end)
+{
+        struct run run;
+        int        ret = 0;
+
+        if (limits) {
+                if (limits->max_states &&
+                    regex->nstates > limits->max_states)
+                        return MATCH_ERR_STATES;
+
+                if (limits->max_memory &&
+                    run_size (regex) > limits->max_memory)
+                        return MATCH_ERR_MEMORY;
+        }
+
+        if (run_init (&run, regex) != 0)
+                return MATCH_ERR_NOMEM;
+
+        run_begin (&run, mode, 0, limits);
+        run_feed (&run, buf, len);
+        ret = run_end (&run, end);
+
+        run_fini (&run);
+
+        return ret;
+}
+
+
+/*
+ * Where @required first occurs in @buf from @from on, by Horspool:
+ * the last byte of the window picks how far it can move. Returns -1
+ * if it does not.
+ */
+ssize_t
+required_find (const struct required *required, const uint8_t *buf,
+               size_t len, size_t from)
+{
+        const uint8_t *fold = NULL;
+        size_t         k = 0;
+        size_t         i = 0;
+        size_t         j = 0;
+        uint8_t        last = 0;
+
+        fold = required->fold;
+        k = required->len;
+        last = required->bytes[k - 1];
+
+        for (i = from; i + k <= len; i += required->skip[buf[i + k - 1]]) {
+                if (fold[buf[i + k - 1]] != last)
+                        continue;
+
+                for (j = 0; j + 1 < k; j++) {
+                        if (fold[buf[i + j]] != required->bytes[j])
+                                break;
+                }
+                if (j + 1 == k)
+                        return i;
+        }
+
+        return -1;
+}
+
+
+/*
+ * search_run() for a regex with a required string: only the stretch
+ * of input a match through an occurrence of it could cover is run.
+ * Stretches that overlap are run as one, so no byte is read twice.
+ */
+int
+search_required (struct run *run, const uint8_t *buf, size_t len,
+                 const struct match_limits *limits)
+{
+        const struct required *required = NULL;
+        ssize_t                at = 0;
+        size_t                 from = 0;
+        size_t                 start = 0;
+        size_t                 stop = 0;
+        size_t                 fed = 0;
+        size_t                 end = 0;
+        int                    begun = 0;
+        int                    ret = 0;
+
+        required = run->regex->required;
+
+        while ((at = required_find (required, buf, len, from)) >= 0) {
+                if (required->always)
+                        return 1;
+
+                start = 0;
+                if (required->before >= 0 && at > required->before)
+                        start = at - required->before;
+
+                stop = len;
+                if (required->after >= 0 &&
+                    len - at - required->len > (size_t) required->after)
+                        stop = at + required->len + required->after;
+
+                /* a gap since the last stretch: that one is over */
+                if (begun && start > fed) {
+                        ret = run_end (run, &end);
+                        if (ret)
+                                return ret;
+                        begun = 0;
+                }
+
+                if (!begun) {
+                        run_begin (run, MATCH_PREFIX, 1, limits);
+                        fed = start;
+                        begun = 1;
+                }
+
+                if (stop > fed) {
+                        run_feed (run, buf + fed, stop - fed);
+                        fed = stop;
+                }
+
+                if (run->done || fed == len)
+                        break;
+
+                from = at + 1;
+        }
+
+        return begun ? run_end (run, &end) : 0;
+}
+
+
+/*
+ * Look for a match of @run's regex starting anywhere in @buf. Returns 1
+ * if there is one, 0 if not, or a MATCH_ERR_* once @limits are hit.
+ * @run is reused from call to call.
+ */
+int
+search_run (struct run *run, const uint8_t *buf, size_t len,
+            const struct match_limits *limits)
+{
+        size_t end = 0;
+
+        if (run->regex->required)
+                return search_required (run, buf, len, limits);
+
+        run_begin (run, MATCH_PREFIX, 1, limits);
+        run_feed (run, buf, len);
+
+        return run_end (run, &end);
+}
+
+
+/*
+ * Does @regex match anywhere in @buf, within @limits (may be NULL)?
+ * Returns 1 if it does, 0 if not, a MATCH_ERR_* if it gave up.
+ */
+int
+search_regex (struct regex *regex, const uint8_t *buf, size_t len,
+              const struct match_limits *limits)
+{
+        struct run run;
+        int        ret = 0;
+
+        if (limits) {
+                if (limits->max_states &&
+                    regex->nstates > limits->max_states)
+                        return MATCH_ERR_STATES;
+
+                if (limits->max_memory &&
+                    run_size (regex) > limits->max_memory)
+                        return MATCH_ERR_MEMORY;
+        }
+
+        if (run_init (&run, regex) != 0)
+                return MATCH_ERR_NOMEM;
+
+        ret = search_run (&run, buf, len, limits);
+
+        run_fini (&run);
+
+        return ret;
+}
+
+
+/*
+ * Match @buf with the one-pass table of @regex, following its one
+ * position per byte. Returns like match_regex().
+ */
+int
+onepass_match (struct regex *regex, const uint8_t *buf, size_t len,
+               match_mode_t mode, size_t *end)
+{
+        const struct onepass *onepass = regex->onepass;
+        const int            *next = onepass->next;
+        size_t                i = 0;
+        int                   p = ONEPASS_START;
+        int                   found = 0;
+
+        if (mode == MATCH_FULL) {
+                for (i = 0; i < len && p != ONEPASS_DEAD; i++)
+                        p = next[p * 256 + buf[i]];
+
+                *end = len;
+                return onepass->accept[p];
+        }
+
+        for (i = 0; p != ONEPASS_DEAD; i++) {
+                if (onepass->accept[p]) {
+                        found = 1;
+                        *end = i;
+                        if (mode != MATCH_LONGEST)
+                                break;
+                }
+                if (i == len)
+                        break;
+                p = next[p * 256 + buf[i]];
+        }
+
+        return found;
+}
+
+
+struct backtrack {
+        struct state      *state;
+        size_t             pos;
+};
+
+
+/*
+ * Depth first matching, for regexes without counted repetitions. Each
+ * pair of a state and an input position is tried at most once, kept
+ * in a bit set, so it takes the time of the pairs actually reached
+ * instead of a visit to every state per byte. Returns like
+ * match_regex(); steps are pairs tried.
+ */
+int
+backtrack_match (struct regex *regex, const uint8_t *buf, size_t len,
+                 match_mode_t mode, const struct match_limits *limits,
+                 size_t *end)
+{
+        struct backtrack  *stack = NULL;
+        struct backtrack  *more = NULL;
+        struct backtrack   top;
+        struct transition *trav = NULL;
+        uint64_t          *seen = NULL;
+        size_t             words = 0;
+        size_t             depth = 0;
+        size_t             size = 0;
+        size_t             bit = 0;
+        size_t             next = 0;
+        size_t             best = 0;
+        unsigned long      steps = 0;
+        int                found = 0;
+
+        words = ((len + 1) * regex->nstates + 63) / 64;
+        if (limits && limits->max_memory &&
+            words * sizeof (*seen) > limits->max_memory)
+                return MATCH_ERR_MEMORY;
+
+        seen = calloc (words, sizeof (*seen));
+        size = 64;
+        stack = malloc (size * sizeof (*stack));
+        if (!seen || !stack) {
+                free (seen);
+                free (stack);
+                return MATCH_ERR_NOMEM;
+        }
+
+        stack[depth].state = &regex->start;
+        stack[depth++].pos = 0;
+
+        while (depth) {
+                top = stack[--depth];
+
+                bit = top.pos * regex->nstates + top.state->idx;
+                if (seen[bit / 64] & (1ULL << (bit % 64)))
+                        continue;
+                seen[bit / 64] |= 1ULL << (bit % 64);
+
+                if (limits && limits->max_steps &&
+                    ++steps > limits->max_steps) {
+                        found = MATCH_ERR_STEPS;
+                        break;
+                }
+
+                if (top.state->is_final &&
+                    (mode != MATCH_FULL || top.pos == len)) {
+                        if (!found || (mode == MATCH_LONGEST ?
+                                       top.pos > best : top.pos < best))
+                                best = top.pos;
+                        found = 1;
+
+                        /* no other end can be better */
+                        if (mode == MATCH_FULL ||
+                            (mode == MATCH_LONGEST && best == len) ||
+                            (mode != MATCH_LONGEST && best == 0))
+                                break;
+                }
+
+                for (trav = top.state->transitions; trav;
+                     trav = trav->next) {
+                        if (!trav->to->is_live)
+                                continue;
+
+                        if (trav->label == E)
+                                next = top.pos;
+                        else if (top.pos < len &&
+                                 transition_matches (trav, buf[top.pos]))
+                                next = top.pos + 1;
+                        else
+                                continue;
+
+                        if (depth == size) {
+                                more = realloc (stack, 2 * size *
+                                                sizeof (*stack));
+                                if (!more) {
+                                        found = MATCH_ERR_NOMEM;
+                                        goto out;
+                                }
+                                stack = more;
+                                size *= 2;
+                        }
+                        stack[depth].state = trav->to;
+                        stack[depth++].pos = next;
+                }
+        }
+
+out:
+        free (seen);
+        free (stack);
+
+        if (found == 1)
+                *end = best;
+
+        return found;
+}
+
+
+/*
+ * Graphviz output. Counts from a profile colour a state from white to
+ * red and thicken a transition as they near the largest of them.
+ */
+
+/* a byte in a DOT label */
+void
+dot_byte (FILE *out, int byte)
+{
+        if (byte == '"' || byte == '\\')
+                fprintf (out, "\\%c", byte);
+        else if (byte > ' ' && byte < 0x7f)
+                fputc (byte, out);
+        else
+                fprintf (out, "\\\\x%02x", byte);
+}
+
+
+void
+dot_heat (FILE *out, unsigned long hits, unsigned long max)
+{
+        if (max)
+                fprintf (out, ", style=filled, fillcolor=\"0.000 %.3f 1.000\"",
+                         (double) hits / max);
+}
+
+
+void
+dot_label (FILE *out, struct transition *trans)
+{
+        switch (trans->label) {
+        case ANY:     fputc ('.', out); break;
+        case E:       fputs ("E", out); break;
+        case E_ENTER: fputs ("E enter", out); break;
+        case E_BODY:  fputs ("E body", out); break;
+        case E_AGAIN: fputs ("E again", out); break;
+        case E_EXIT:  fputs ("E exit", out); break;
+        case RANGE:
+                fputc ('[', out);
+                dot_byte (out, trans->lo);
+                fputc ('-', out);
+                dot_byte (out, trans->hi);
+                fputc (']', out);
+                break;
+        default:
+                dot_byte (out, trans->label);
+        }
+}
+
+
+struct dotting {
+        FILE                 *out;
+        const struct profile *profile;
+        unsigned long         max_state;
+        unsigned long         max_transition;
+};
+
+
+int
+dot_max_transition (struct state *state, struct transition *each,
+                    void *data)
+{
+        struct dotting *dotting = NULL;
+        unsigned long   hits = 0;
+
+        dotting = data;
+
+        hits = dotting->profile->transitions[each->idx];
+        if (hits > dotting->max_transition)
+                dotting->max_transition = hits;
+
+        return 0;
+}
+
+
+int
+dot_max (struct state *state, void *data)
+{
+        struct dotting *dotting = NULL;
+        unsigned long   hits = 0;
+
+        dotting = data;
+
+        hits = dotting->profile->states[state->idx];
+        if (hits > dotting->max_state)
+                dotting->max_state = hits;
+
+        transition_foreach (state, dot_max_transition, data);
+
+        return 0;
+}
+
+
+int
+dot_transition (struct state *state, struct transition *each, void *data)
+{
+        struct dotting *dotting = NULL;
+        unsigned long   hits = 0;
+
+        dotting = data;
+
+        fprintf (dotting->out, "        q%d -> q%d [label=\"", state->idx,
+                 each->to->idx);
+        dot_label (dotting->out, each);
+
+        if (dotting->profile) {
+                hits = dotting->profile->transitions[each->idx];
+                fprintf (dotting->out, " (%lu)\"", hits);
+                if (dotting->max_transition)
+                        fprintf (dotting->out, ", penwidth=%.1f",
+                                 1 + 4.0 * hits / dotting->max_transition);
+        } else {
+                fputc ('"', dotting->out);
+        }
+
+        if (is_E (each->label))
+                fputs (", style=dashed", dotting->out);
+        fputs ("];\n", dotting->out);
+
+        return 0;
+}
+
+
+int
+dot_state (struct state *state, void *data)
+{
+        struct dotting *dotting = NULL;
+        unsigned long   hits = 0;
+
+        dotting = data;
+
+        fprintf (dotting->out, "        q%d [label=\"%d", state->idx,
+                 state->idx);
+        if (state->counter)
+                fprintf (dotting->out, "\\n{%d,%d}", state->counter->min,
+                         state->counter->max);
+        if (dotting->profile) {
+                hits = dotting->profile->states[state->idx];
+                fprintf (dotting->out, "\\n%lu", hits);
+        }
+        fputc ('"', dotting->out);
+
+        if (state->is_final)
+                fputs (", shape=doublecircle", dotting->out);
+        if (!state->is_live)
+                fputs (", color=gray", dotting->out);
+        if (dotting->profile)
+                dot_heat (dotting->out, hits, dotting->max_state);
+        fputs ("];\n", dotting->out);
+
+        if (state->is_start)
+                fprintf (dotting->out, "        start -> q%d;\n",
+                         state->idx);
+
+        transition_foreach (state, dot_transition, data);
+
+        return 0;
+}
+
+
+/*
+ * Write @regex to @out as a Graphviz digraph, with the counts of
+ * @profile (may be NULL). States are named by their index; dead end
+ * states are gray, E transitions dashed.
+ */
+void
+regex_dot (struct regex *regex, const struct profile *profile, FILE *out)
+{
+        struct dotting dotting = { .out = out, .profile = profile };
+
+        if (profile)
+                state_foreach (&regex->start, dot_max, &dotting);
+
+        fprintf (out, "digraph regex {\n"
+                 "        rankdir=LR;\n"
+                 "        node [shape=circle];\n"
+                 "        start [shape=point];\n");
+        state_foreach (&regex->start, dot_state, &dotting);
+        fprintf (out, "}\n");
+}
+
+
+/*
+ * The RegExp determinized: each DFA state is a set of pebbled NFA
+ * states, built eagerly within a memory budget. Input bytes that no
+ * transition tells apart share a class, the table has one column per
+ * class. Programs with counted repetitions are not built, their sets
+ * of counts are not finite state.
+ *
+ * With @search a match may start anywhere: start pebbles are put
+ * down again after every byte, and final states are never left.
+ */
+
+#define DFA_DEAD          0           /* the empty set, never left */
+#define DFA_MEMORY_MAX    (64 << 20)  /* default budget of a DFA */
+#define DFA_PART_MIN      (64 << 10)  /* least input per thread */
+#define DFA_CHECKPOINT    4096        /* bytes between checkpoints */
+#define FLOW_STATE_BITS   24          /* of a flow_t, the rest counts bytes */
+
+
+struct dfa {
+        int                search;      /* match anywhere */
+        int                nclasses;
+        uint8_t            classes[256]; /* byte to class */
+        uint8_t            reps[256];   /* class to its first byte */
+        int                nstates;
+        int                start;
+        int               *trans;       /* [state * nclasses + class] */
+        char              *is_final;
+        int                words;       /* of a set of NFA states */
+        uint64_t          *sets;        /* [state * words] */
+        int               *table;       /* hash of sets, state + 1 */
+        int                table_size;
+        int                size_states; /* room for */
+        size_t             size;        /* bytes held */
+        size_t             max_size;
+};
+
+
+int
+mark_boundaries (struct state *state, void *data)
+{
+        struct transition *trav = NULL;
+        char              *starts = NULL;
+
+        starts = data;
+
+        for (trav = state->transitions; trav; trav = trav->next) {
+                if (trav->label < 256) {
+                        starts[trav->label] = 1;
+                        starts[trav->label + 1] = 1;
+                } else if (trav->label == RANGE) {
+                        starts[trav->lo] = 1;
+                        starts[trav->hi + 1] = 1;
+                }
+        }
+
+        return 0;
+}
+
+
+void
+dfa_classes (struct dfa *dfa, struct regex *regex)
+{
+        char starts[257] = { 0, };
+        int  i = 0;
+
+        /* a class starts at every byte where some transition starts
+           or stops matching */
+        state_foreach (&regex->start, mark_boundaries, starts);
+
+        dfa->nclasses = 0;
+        for (i = 0; i < 256; i++) {
+                if (i == 0 || starts[i])
+                        dfa->reps[dfa->nclasses++] = i;
+                dfa->classes[i] = dfa->nclasses - 1;
+        }
+}
+
+
+void
+dfa_free (struct dfa *dfa)
+{
+        free (dfa->trans);
+        free (dfa->is_final);
+        free (dfa->sets);
+        free (dfa->table);
+        free (dfa);
+}
+
+
+uint64_t
+set_hash (const uint64_t *set, int words)
+{
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        int      i = 0;
+
+        for (i = 0; i < words; i++) {
+                hash ^= set[i];
+                hash *= 0x100000001b3ULL;
+                hash ^= hash >> 29;
+        }
+
+        return hash;
+}
+
+
+/* bytes a DFA state takes, in all of the tables */
+size_t
+dfa_state_size (const struct dfa *dfa)
+{
+        return dfa->nclasses * sizeof (*dfa->trans) + 1 +
+                dfa->words * sizeof (*dfa->sets) + 2 * sizeof (*dfa->table);
+}
+
+
+/*
+ * Make room for twice the states, or as many as the budget leaves
+ * room for. Returns -1 when out of memory or budget.
+ */
+int
+dfa_grow (struct dfa *dfa)
+{
+        int      *trans = NULL;
+        char     *is_final = NULL;
+        uint64_t *sets = NULL;
+        int      *table = NULL;
+        size_t    most = 0;
+        int       size = 0;
+        int       q = 0;
+        int       i = 0;
+
+        size = dfa->size_states ? 2 * dfa->size_states : 64;
+
+        /* the tables are allocated for all of them, not as they fill */
+        if (dfa->max_size > sizeof (*dfa))
+                most = (dfa->max_size - sizeof (*dfa)) /
+                        dfa_state_size (dfa);
+        if ((size_t) size > most)
+                size = most;
+        if (size <= dfa->size_states)
+                return -1;
+
+        trans = realloc (dfa->trans, (size_t) size * dfa->nclasses *
+                         sizeof (*trans));
+        if (trans)
+                dfa->trans = trans;
+        is_final = realloc (dfa->is_final, size);
+        if (is_final)
+                dfa->is_final = is_final;
+        sets = realloc (dfa->sets, (size_t) size * dfa->words *
+                        sizeof (*sets));
+        if (sets)
+                dfa->sets = sets;
+        table = calloc (2 * size, sizeof (*table));
+        if (!trans || !is_final || !sets || !table) {
+                free (table);
+                return -1;
+        }
+
+        /* rehash, the table is kept at most half full */
+        for (q = 0; q < dfa->nstates; q++) {
+                i = set_hash (dfa->sets + (size_t) q * dfa->words,
+                              dfa->words) % (2 * size);
+                while (table[i])
+                        i = (i + 1) % (2 * size);
+                table[i] = q + 1;
+        }
+
+        free (dfa->table);
+        dfa->table = table;
+        dfa->table_size = 2 * size;
+        dfa->size_states = size;
+
+        return 0;
+}
+
+
+/*
+ * The DFA state for the pebbles of @run, added if new. Returns -1 when
+ * out of memory or budget.
+ */
+int
+dfa_state (struct dfa *dfa, struct run *run, uint64_t *set)
+{
+        struct regex *regex = NULL;
+        size_t        state_size = 0;
+        int           i = 0;
+        int           q = 0;
+
+        regex = run->regex;
+
+        memset (set, 0, dfa->words * sizeof (*set));
+        for (i = 0; i < regex->nstates; i++) {
+                if (run->pebble[i])
+                        set[i / 64] |= 1ULL << (i % 64);
+        }
+
+        i = set_hash (set, dfa->words) % dfa->table_size;
+        for (; dfa->table[i]; i = (i + 1) % dfa->table_size) {
+                q = dfa->table[i] - 1;
+                if (!memcmp (dfa->sets + (size_t) q * dfa->words, set,
+                             dfa->words * sizeof (*set)))
+                        return q;
+        }
+
+        state_size = dfa_state_size (dfa);
+        if (dfa->size + state_size > dfa->max_size)
+                return -1;
+
+        if (dfa->nstates == dfa->size_states) {
+                if (dfa_grow (dfa) != 0)
+                        return -1;
+                return dfa_state (dfa, run, set);
+        }
+
+        q = dfa->nstates++;
+        dfa->size += state_size;
+        dfa->table[i] = q + 1;
+        memcpy (dfa->sets + (size_t) q * dfa->words, set,
+                dfa->words * sizeof (*set));
+        dfa->is_final[q] = state_foreach (&regex->start, pebble_in_final,
+                                          run);
+
+        return q;
+}
+
+
+void
+run_load (struct run *run, const uint64_t *set)
+{
+        int i = 0;
+
+        run_reset (run);
+
+        for (i = 0; i < run->regex->nstates; i++) {
+                if (set[i / 64] & (1ULL << (i % 64)))
+                        run->pebble[i] = 1;
+        }
+}
+
+
+/* @byte, as a literal string of @regex is matched */
+int
+literal_fold (struct regex *regex, int byte)
+{
+        if ((regex->flags & REGEX_ICASE) && byte >= 'A' && byte <= 'Z')
+                return byte + 'a' - 'A';
+
+        return byte;
+}
+
+
+/*
+ * The DFA of a regex that is a set of literal strings, built as an
+ * Aho-Corasick automaton in time linear in the strings instead of by
+ * subsets: a trie of them, where with @search a missing transition
+ * goes where the longest suffix that is also a prefix of one goes,
+ * and without it to DFA_DEAD. Returns NULL if over @max_size.
+ */
+struct dfa *
+dfa_literals (struct regex *regex, int search, size_t max_size)
+{
+        const struct literals *literals = NULL;
+        struct dfa            *dfa = NULL;
+        const uint8_t         *word = NULL;
+        int                   *fail = NULL;
+        int                   *queue = NULL;
+        int                    class_of[256] = { 0, };
+        size_t                 len = 0;
+        size_t                 i = 0;
+        int                    nstates = 0;
+        int                    head = 0;
+        int                    tail = 0;
+        int                    nc = 0;
+        int                    q = 0;
+        int                    t = 0;
+        int                    c = 0;
+        int                    b = 0;
+        int                    n = 0;
+
+        literals = regex->literals;
+
+        dfa = calloc (1, sizeof (*dfa));
+        if (!dfa)
+                return NULL;
+
+        dfa->search = search;
+        dfa->max_size = max_size;
+        dfa->size = sizeof (*dfa);
+
+        /* a class per byte in the strings, with REGEX_ICASE one for
+           both cases of an ASCII letter; the other bytes share 0 */
+        for (i = 0; i < literals->len; i++)
+                class_of[literal_fold (regex, literals->bytes[i])] = 1;
+
+        nc = 1;
+        for (b = 0; b < 256; b++) {
+                if (class_of[b])
+                        class_of[b] = nc++;
+        }
+        for (b = 0; b < 256; b++) {
+                dfa->classes[b] = class_of[literal_fold (regex, b)];
+                if (b && dfa->classes[b] && !dfa->reps[dfa->classes[b]])
+                        dfa->reps[dfa->classes[b]] = b;
+        }
+        dfa->nclasses = nc;
+
+        /* DFA_DEAD, the root, and at most a state per byte */
+        nstates = 2 + literals->len;
+        dfa->size += (size_t) nstates * (nc * sizeof (*dfa->trans) + 1);
+        if (dfa->size > max_size)
+                goto fail;
+
+        dfa->trans = calloc ((size_t) nstates * nc, sizeof (*dfa->trans));
+        dfa->is_final = calloc (nstates, 1);
+        fail = calloc (nstates, sizeof (*fail));
+        queue = calloc (nstates, sizeof (*queue));
+        if (!dfa->trans || !dfa->is_final || !fail || !queue)
+                goto fail;
+
+        /* the trie, 0 is no transition yet */
+        dfa->start = 1;
+        dfa->nstates = 2;
+        for (n = 0; n < literals->count; n++) {
+                word = literal (literals, n, &len);
+                q = dfa->start;
+                for (i = 0; i < len; i++) {
+                        c = dfa->classes[word[i]];
+                        if (!dfa->trans[q * nc + c])
+                                dfa->trans[q * nc + c] = dfa->nstates++;
+                        q = dfa->trans[q * nc + c];
+                }
+                dfa->is_final[q] = 1;
+        }
+        dfa->size_states = dfa->nstates;
+
+        if (!search)
+                goto out;
+
+        /* breadth first, so the rows of shorter prefixes are complete;
+           the children of a state are the only transitions it has yet */
+        fail[dfa->start] = dfa->start;
+        queue[tail++] = dfa->start;
+        while (head < tail) {
+                q = queue[head++];
+
+                for (c = 0; c < nc; c++) {
+                        t = dfa->trans[q * nc + c];
+                        if (!t) {
+                                dfa->trans[q * nc + c] = (q == dfa->start) ?
+                                        q : dfa->trans[fail[q] * nc + c];
+                                continue;
+                        }
+
+                        fail[t] = (q == dfa->start) ?
+                                q : dfa->trans[fail[q] * nc + c];
+                        dfa->is_final[t] |= dfa->is_final[fail[t]];
+                        queue[tail++] = t;
+                }
+        }
+
+        /* a search is over once it has matched, like dfa_build() */
+        for (q = 1; q < dfa->nstates; q++) {
+                if (!dfa->is_final[q])
+                        continue;
+                for (c = 0; c < nc; c++)
+                        dfa->trans[q * nc + c] = q;
+        }
+
+out:
+        free (fail);
+        free (queue);
+
+        return dfa;
+
+fail:
+        free (fail);
+        free (queue);
+        dfa_free (dfa);
+
+        return NULL;
+}
+
+
+/*
+ * Determinize @regex in at most @max_size bytes. Returns NULL if it
+ * does not fit, is out of memory or has counted repetitions. A set of
+ * literal strings is built by dfa_literals().
+ */
+struct dfa *
+dfa_build (struct regex *regex, int search, size_t max_size)
+{
+        struct dfa    *dfa = NULL;
+        struct run     run;
+        struct moving  moving = { .run = &run };
+        uint64_t      *set = NULL;
+        int            q = 0;
+        int            c = 0;
+        int            t = 0;
+
+        if (regex->literals)
+                return dfa_literals (regex, search, max_size);
+
+        if (regex->counters)
+                return NULL;
+
+        dfa = calloc (1, sizeof (*dfa));
+        if (!dfa)
+                return NULL;
+
+        dfa->search = search;
+        dfa->words = (regex->nstates + 63) / 64;
+        dfa->max_size = max_size;
+        dfa->size = sizeof (*dfa);
+        dfa_classes (dfa, regex);
+
+        set = calloc (dfa->words, sizeof (*set));
+        if (!set || dfa_grow (dfa) != 0 || run_init (&run, regex) != 0) {
+                free (set);
+                dfa_free (dfa);
+                return NULL;
+        }
+
+        /* the empty set first, it is DFA_DEAD */
+        run_reset (&run);
+        t = dfa_state (dfa, &run, set);
+
+        state_foreach (&regex->start, place_pebble_if_start, &run);
+        state_foreach (&regex->start, commit_pebble, &run);
+        dfa->start = dfa_state (dfa, &run, set);
+        if (t < 0 || dfa->start < 0)
+                goto fail;
+
+        /* states get added at the end while their rows are filled in */
+        for (q = 0; q < dfa->nstates; q++) {
+                for (c = 0; c < dfa->nclasses; c++) {
+                        if (search && dfa->is_final[q]) {
+                                dfa->trans[q * dfa->nclasses + c] = q;
+                                continue;
+                        }
+
+                        run_load (&run, dfa->sets + (size_t) q * dfa->words);
+                        moving.byte = dfa->reps[c];
+                        state_foreach (&regex->start, move_pebble, &moving);
+                        if (search)
+                                state_foreach (&regex->start,
+                                               place_pebble_if_start, &run);
+                        state_foreach (&regex->start, commit_pebble, &run);
+
+                        t = dfa_state (dfa, &run, set);
+                        if (t < 0)
+                                goto fail;
+                        dfa->trans[q * dfa->nclasses + c] = t;
+                }
+        }
+
+        run_fini (&run);
+        free (set);
+
+        return dfa;
+
+fail:
+        run_fini (&run);
+        free (set);
+        dfa_free (dfa);
+
+        return NULL;
+}
+
+
+/* the state @buf takes @dfa to from @state */
+int
+dfa_scan (const struct dfa *dfa, int state, const uint8_t *buf, size_t len)
+{
+        const int *trans = NULL;
+        size_t     i = 0;
+        int        nclasses = 0;
+
+        trans = dfa->trans;
+        nclasses = dfa->nclasses;
+
+        for (i = 0; i < len; i++) {
+                state = trans[state * nclasses + dfa->classes[buf[i]]];
+
+                /* nothing more can change, look every 4 KB */
+                if (!(i & 4095) && (state == DFA_DEAD ||
+                                    (dfa->search && dfa->is_final[state])))
+                        break;
+        }
+
+        return state;
+}
+
+
+/*
+ * Where @buf takes each of the states of @dfa: @map[q] for state q.
+ * All the states are run at once as lanes; lanes that end up in the
+ * same state are merged, after 1, 2, 4 .. 64 bytes and every 64 bytes
+ * after that, so soon only a few are left.
+ */
+int
+dfa_map (const struct dfa *dfa, const uint8_t *buf, size_t len, int *map)
+{
+        int    *lanes = NULL;
+        int    *seen = NULL;
+        int    *remap = NULL;
+        int     nlanes = 0;
+        int     merged = 0;
+        int     cls = 0;
+        int     l = 0;
+        int     q = 0;
+        size_t  next = 1;
+        size_t  i = 0;
+
+        lanes = malloc (3 * dfa->nstates * sizeof (*lanes));
+        if (!lanes)
+                return -1;
+        seen = lanes + dfa->nstates;
+        remap = seen + dfa->nstates;
+
+        /* map[q] is the lane of state q until the end */
+        for (q = 0; q < dfa->nstates; q++) {
+                lanes[q] = q;
+                map[q] = q;
+                seen[q] = -1;
+        }
+        nlanes = dfa->nstates;
+
+        for (i = 0; i < len && nlanes > 1; i++) {
+                cls = dfa->classes[buf[i]];
+                for (l = 0; l < nlanes; l++)
+                        lanes[l] = dfa->trans[lanes[l] * dfa->nclasses + cls];
+
+                if (i + 1 != next)
+                        continue;
+                next = (next < 64) ? 2 * next : next + 64;
+
+                /* seen[state] is the lane it is kept in */
+                merged = 0;
+                for (l = 0; l < nlanes; l++) {
+                        if (seen[lanes[l]] == -1)
+                                seen[lanes[l]] = merged++;
+                        remap[l] = seen[lanes[l]];
+                }
+
+                if (merged < nlanes) {
+                        for (q = 0; q < dfa->nstates; q++)
+                                map[q] = remap[map[q]];
+                        for (l = 0; l < nlanes; l++)
+                                lanes[remap[l]] = lanes[l];
+                }
+
+                for (l = 0; l < merged; l++)
+                        seen[lanes[l]] = -1;
+                nlanes = merged;
+        }
+
+        if (nlanes == 1 && i < len)
+                lanes[0] = dfa_scan (dfa, lanes[0], buf + i, len - i);
+
+        for (q = 0; q < dfa->nstates; q++)
+                map[q] = lanes[map[q]];
+
+        free (lanes);
+
+        return 0;
+}
+
+
+struct dfa_part {
+        const struct dfa  *dfa;
+        const uint8_t     *buf;
+        size_t             len;
+        int               *map;         /* NULL: from the start state */
+        int                end;
+        int                ret;
+        pthread_t          thread;
+};
+
+
+void *
+dfa_part_run (void *data)
+{
+        struct dfa_part *part = NULL;
+
+        part = data;
+
+        if (part->map)
+                part->ret = dfa_map (part->dfa, part->buf, part->len,
+                                     part->map);
+        else
+                part->end = dfa_scan (part->dfa, part->dfa->start,
+                                      part->buf, part->len);
+
+        return NULL;
+}
+
+
+/*
+ * Run @buf through @dfa on @nthreads threads. The first part is run
+ * from the start state, the others from every state at once; then the
+ * state each part ends in is looked up part by part. Returns 1 if
+ * @buf is accepted, 0 if not, MATCH_ERR_NOMEM if out of memory.
+ */
+int
+dfa_match (const struct dfa *dfa, const uint8_t *buf, size_t len,
+           int nthreads)
+{
+        struct dfa_part *parts = NULL;
+        int             *maps = NULL;
+        int              started = 0;
+        int              state = 0;
+        int              ret = 0;
+        int              n = 0;
+
+        if ((size_t) nthreads > len / DFA_PART_MIN)
+                nthreads = len / DFA_PART_MIN;
+        if (nthreads < 1)
+                nthreads = 1;
+
+        parts = calloc (nthreads, sizeof (*parts));
+        maps = malloc ((size_t) (nthreads - 1) * dfa->nstates *
+                       sizeof (*maps) + 1);
+        if (!parts || !maps) {
+                free (parts);
+                free (maps);
+                return MATCH_ERR_NOMEM;
+        }
+
+        for (n = 0; n < nthreads; n++) {
+                parts[n].dfa = dfa;
+                parts[n].buf = buf + len * n / nthreads;
+                parts[n].len = len * (n + 1) / nthreads - len * n / nthreads;
+                if (n)
+                        parts[n].map = maps + (size_t) (n - 1) * dfa->nstates;
+        }
+
+        for (n = 1; n < nthreads; n++) {
+                if (pthread_create (&parts[n].thread, NULL, dfa_part_run,
+                                    &parts[n]) != 0)
+                        break;
+        }
+        started = n;
+
+        dfa_part_run (&parts[0]);
+        for (n = started; n < nthreads; n++) /* could not get threads */
+                dfa_part_run (&parts[n]);
+
+        for (n = 1; n < started; n++)
+                pthread_join (parts[n].thread, NULL);
+
+        state = parts[0].end;
+        for (n = 1; n < nthreads; n++) {
+                if (parts[n].ret != 0)
+                        ret = MATCH_ERR_NOMEM;
+                else
+                        state = parts[n].map[state];
+        }
+
+        if (ret == 0)
+                ret = dfa->is_final[state];
+
+        free (maps);
+        free (parts);
+
+        return ret;
+}
+
+
+/*
+ * Matching a document that keeps being edited. The DFA state is kept
+ * at checkpoints about every DFA_CHECKPOINT bytes; after an edit it is
+ * run again from the last checkpoint before it, up to the first
+ * checkpoint after it that comes out in the state it was in before.
+ * The bytes from there on are the ones that followed it before, so
+ * everything after it stays as it was, the end state too.
+ */
+
+struct checkpoint {
+        size_t             offset;      /* bytes of the document before */
+        int                state;       /* DFA state after them */
+};
+
+
+struct checkpoints {
+        const struct dfa  *dfa;
+        struct checkpoint *points;      /* by offset, the first at 0 */
+        size_t             count;
+        size_t             size;        /* room in points */
+        size_t             len;         /* of the document */
+        int                state;       /* at its end */
+};
+
+
+int
+checkpoint_add (struct checkpoints *cps, size_t offset, int state)
+{
+        struct checkpoint *more = NULL;
+
+        if (cps->count == cps->size) {
+                more = realloc (cps->points, 2 * cps->size *
+                                sizeof (*more));
+                if (!more)
+                        return -1;
+                cps->points = more;
+                cps->size *= 2;
+        }
+
+        cps->points[cps->count].offset = offset;
+        cps->points[cps->count++].state = state;
+
+        return 0;
+}
+
+
+/*
+ * Run @buf on from the last checkpoint of @cps, in @state, up to @to,
+ * adding checkpoints on the way. Returns the state at @to, -1 if out
+ * of memory.
+ */
+int
+checkpoints_run (struct checkpoints *cps, int state, const uint8_t *buf,
+                 size_t to)
+{
+        size_t from = 0;
+        size_t next = 0;
+
+        from = cps->points[cps->count - 1].offset;
+
+        /* none closer than DFA_CHECKPOINT to @to, which may have one */
+        while (from < to) {
+                next = from + DFA_CHECKPOINT;
+                if (next + DFA_CHECKPOINT > to)
+                        return dfa_scan (cps->dfa, state, buf + from,
+                                         to - from);
+
+                state = dfa_scan (cps->dfa, state, buf + from, next - from);
+                if (checkpoint_add (cps, next, state) != 0)
+                        return -1;
+                from = next;
+        }
+
+        return state;
+}
+
+
+/*
+ * Checkpoints of the @len bytes of the document @buf on @dfa, which
+ * must outlive them. Returns NULL if out of memory.
+ */
+struct checkpoints *
+checkpoints_new (const struct dfa *dfa, const uint8_t *buf, size_t len)
+{
+        struct checkpoints *cps = NULL;
+
+        cps = calloc (1, sizeof (*cps));
+        if (!cps)
+                return NULL;
+
+        cps->dfa = dfa;
+        cps->size = 16;
+        cps->points = malloc (cps->size * sizeof (*cps->points));
+        if (!cps->points || checkpoint_add (cps, 0, dfa->start) != 0)
+                goto fail;
+
+        cps->len = len;
+        cps->state = checkpoints_run (cps, dfa->start, buf, len);
+        if (cps->state < 0)
+                goto fail;
+
+        return cps;
+
+fail:
+        free (cps->points);
+        free (cps);
+
+        return NULL;
+}
+
+
+/*
+ * Take in an edit of the document: @removed bytes at @at were replaced
+ * by @added, giving the @len bytes of @buf. The work is that of the
+ * bytes from the checkpoint before @at to the one the states agree
+ * again at. Returns whether the document now matches, or
+ * MATCH_ERR_NOMEM with @cps left as it was.
+ */
+int
+checkpoints_edit (struct checkpoints *cps, const uint8_t *buf, size_t len,
+                  size_t at, size_t removed, size_t added)
+{
+        struct checkpoints  edited = *cps;
+        struct checkpoint  *old = NULL;
+        size_t              lo = 0;
+        size_t              hi = 0;
+        size_t              mid = 0;
+        size_t              j = 0;
+        int                 state = 0;
+
+        /* the last checkpoint at or before @at, the first is at 0 */
+        lo = 0;
+        hi = cps->count;
+        while (hi - lo > 1) {
+                mid = lo + (hi - lo) / 2;
+                if (cps->points[mid].offset <= at)
+                        lo = mid;
+                else
+                        hi = mid;
+        }
+
+        edited.size = cps->count + 16;
+        edited.points = malloc (edited.size * sizeof (*edited.points));
+        if (!edited.points)
+                return MATCH_ERR_NOMEM;
+        memcpy (edited.points, cps->points, (lo + 1) *
+                sizeof (*edited.points));
+        edited.count = lo + 1;
+        edited.len = len;
+
+        /* those in the removed bytes are gone */
+        for (j = lo + 1; j < cps->count &&
+                     cps->points[j].offset < at + removed; j++)
+                ;
+
+        state = cps->points[lo].state;
+        for (; j < cps->count; j++) {
+                old = &cps->points[j];
+
+                state = checkpoints_run (&edited, state, buf,
+                                         old->offset - removed + added);
+                if (state < 0)
+                        goto fail;
+
+                if (state == old->state)
+                        break;
+
+                if (checkpoint_add (&edited, old->offset - removed + added,
+                                    state) != 0)
+                        goto fail;
+        }
+
+        if (j < cps->count) {
+                /* back in step, the rest is as it was */
+                for (; j < cps->count; j++) {
+                        if (checkpoint_add (&edited, cps->points[j].offset -
+                                            removed + added,
+                                            cps->points[j].state) != 0)
+                                goto fail;
+                }
+                edited.state = cps->state;
+        } else {
+                edited.state = checkpoints_run (&edited, state, buf, len);
+                if (edited.state < 0)
+                        goto fail;
+        }
+
+        free (cps->points);
+        *cps = edited;
+
+        return cps->dfa->is_final[cps->state];
+
+fail:
+        free (edited.points);
+
+        return MATCH_ERR_NOMEM;
+}
+
+
+/* whether the document of @cps, as last edited, matches */
+int
+checkpoints_match (const struct checkpoints *cps)
+{
+        return cps->dfa->is_final[cps->state];
+}
+
+
+void
+checkpoints_free (struct checkpoints *cps)
+{
+        free (cps->points);
+        free (cps);
+}
+
+
+/*
+ * Many streams matched at once, e.g. network flows, each with nothing
+ * but a flow_t kept for it, in an array of the caller's: its DFA state
+ * in the low FLOW_STATE_BITS and the bytes fed to it, modulo 2^40,
+ * above them. Packets come in batches; flows_feed() runs them in the
+ * order of the state of their flow, so the same rows of dfa->trans
+ * are used one after the other, and those of one flow in the order
+ * they came in.
+ */
+
+typedef uint64_t flow_t;
+
+#define FLOW_STATE_MASK   ((1ULL << FLOW_STATE_BITS) - 1)
+
+#define flow_state(flow)  ((int) ((flow) & FLOW_STATE_MASK))
+#define flow_offset(flow) ((uint64_t) (flow) >> FLOW_STATE_BITS)
+
+
+struct flow_packet {
+        uint32_t           state;       /* of its flow, at the start */
+        size_t             n;           /* in the batch */
+};
+
+
+/*
+ * Set @flow to one of @dfa that nothing has been fed to. Returns -1 if
+ * @dfa has too many states for a flow_t.
+ */
+int
+flow_start (const struct dfa *dfa, flow_t *flow)
+{
+        if (dfa->nstates > (1 << FLOW_STATE_BITS))
+                return -1;
+
+        *flow = dfa->start;
+
+        return 0;
+}
+
+
+/* whether what was fed to @flow so far matches */
+int
+flow_match (const struct dfa *dfa, flow_t flow)
+{
+        return dfa->is_final[flow_state (flow)];
+}
+
+
+int
+compare_packets (const void *one, const void *two)
+{
+        const struct flow_packet *a = one;
+        const struct flow_packet *b = two;
+
+        if (a->state != b->state)
+                return a->state < b->state ? -1 : 1;
+
+        return a->n < b->n ? -1 : a->n > b->n;
+}
+
+
+/*
+ * Feed @n packets to @flows: packet i is the @lens[i] bytes at
+ * @bufs[i], of the flow at @flows[@ids[i]]. The flows must all have
+ * come from flow_start() of @dfa. Returns 0, or MATCH_ERR_NOMEM with
+ * none of them fed.
+ */
+int
+flows_feed (const struct dfa *dfa, flow_t *flows, const size_t *ids,
+            const uint8_t *const *bufs, const size_t *lens, size_t n)
+{
+        struct flow_packet *packets = NULL;
+        flow_t             *flow = NULL;
+        uint64_t            offset = 0;
+        size_t              i = 0;
+        int                 state = 0;
+
+        if (n == 0)
+                return 0;
+
+        packets = malloc (n * sizeof (*packets));
+        if (!packets)
+                return MATCH_ERR_NOMEM;
+
+        for (i = 0; i < n; i++) {
+                packets[i].state = flow_state (flows[ids[i]]);
+                packets[i].n = i;
+        }
+
+        /* a flow's packets share its state, so they stay in order */
+        qsort (packets, n, sizeof (*packets), compare_packets);
+
+        for (i = 0; i < n; i++) {
+                flow = &flows[ids[packets[i].n]];
+                state = flow_state (*flow);
+                offset = flow_offset (*flow) + lens[packets[i].n];
+
+                if (state != DFA_DEAD &&
+                    !(dfa->search && dfa->is_final[state]))
+                        state = dfa_scan (dfa, state, bufs[packets[i].n],
+                                          lens[packets[i].n]);
+
+                *flow = offset << FLOW_STATE_BITS | (flow_t) state;
+        }
+
+        free (packets);
+
+        return 0;
+}
+
+
+/*
+ * Count in @hits, [state * nclasses + class] like dfa->trans, the
+ * transitions @buf takes through @dfa from its start state.
+ */
+void
+dfa_profile (const struct dfa *dfa, const uint8_t *buf, size_t len,
+             unsigned long *hits)
+{
+        size_t i = 0;
+        int    state = 0;
+        int    c = 0;
+
+        state = dfa->start;
+
+        for (i = 0; i < len; i++) {
+                if (state == DFA_DEAD || (dfa->search && dfa->is_final[state]))
+                        break;
+
+                c = dfa->classes[buf[i]];
+                hits[state * dfa->nclasses + c]++;
+                state = dfa->trans[state * dfa->nclasses + c];
+        }
+}
+
+
+/* the bytes of the classes of @dfa that take @q to @to, as ranges */
+void
+dot_classes (FILE *out, const struct dfa *dfa, int q, int to)
+{
+        int first = 1;
+        int lo = -1;
+        int b = 0;
+
+        for (b = 0; b <= 256; b++) {
+                if (b < 256 &&
+                    dfa->trans[q * dfa->nclasses + dfa->classes[b]] == to) {
+                        if (lo < 0)
+                                lo = b;
+                        continue;
+                }
+                if (lo < 0)
+                        continue;
+
+                if (!first)
+                        fputc (' ', out);
+                dot_byte (out, lo);
+                if (b - 1 > lo) {
+                        fputc ('-', out);
+                        dot_byte (out, b - 1);
+                }
+                first = 0;
+                lo = -1;
+        }
+}
+
+
+/*
+ * Write @dfa to @out as a Graphviz digraph, with the counts of @hits
+ * from dfa_profile() (may be NULL). Transitions into DFA_DEAD are left
+ * out, those between the same two states are drawn as one.
+ */
+void
+dfa_dot (const struct dfa *dfa, const unsigned long *hits, FILE *out)
+{
+        unsigned long *state_hits = NULL;
+        unsigned long  max_state = 0;
+        unsigned long  edge_hits = 0;
+        int           *drawn = NULL;
+        int            q = 0;
+        int            c = 0;
+        int            d = 0;
+        int            t = 0;
+
+        state_hits = calloc (dfa->nstates, sizeof (*state_hits));
+        drawn = calloc (dfa->nstates, sizeof (*drawn));
+        if (!state_hits || !drawn) {
+                free (state_hits);
+                free (drawn);
+                return;
+        }
+
+        /* a state is counted each time the match arrives in it */
+        if (hits)
+                state_hits[dfa->start] = 1;
+        for (q = 0; hits && q < dfa->nstates; q++) {
+                for (c = 0; c < dfa->nclasses; c++)
+                        state_hits[dfa->trans[q * dfa->nclasses + c]] +=
+                                hits[q * dfa->nclasses + c];
+        }
+        for (q = 0; hits && q < dfa->nstates; q++) {
+                if (state_hits[q] > max_state)
+                        max_state = state_hits[q];
+        }
+
+        fprintf (out, "digraph dfa {\n"
+                 "        rankdir=LR;\n"
+                 "        node [shape=circle];\n"
+                 "        start [shape=point];\n"
+                 "        start -> d%d;\n", dfa->start);
+
+        for (q = 1; q < dfa->nstates; q++) {
+                fprintf (out, "        d%d [label=\"%d", q, q);
+                if (hits)
+                        fprintf (out, "\\n%lu", state_hits[q]);
+                fputc ('"', out);
+                if (dfa->is_final[q])
+                        fputs (", shape=doublecircle", out);
+                if (hits)
+                        dot_heat (out, state_hits[q], max_state);
+                fputs ("];\n", out);
+        }
+
+        for (q = 1; q < dfa->nstates; q++) {
+                for (c = 0; c < dfa->nclasses; c++) {
+                        t = dfa->trans[q * dfa->nclasses + c];
+                        if (t == DFA_DEAD || drawn[t] == q)
+                                continue;
+                        drawn[t] = q;
+
+                        fprintf (out, "        d%d -> d%d [label=\"", q, t);
+                        dot_classes (out, dfa, q, t);
+                        if (!hits) {
+                                fputs ("\"];\n", out);
+                                continue;
+                        }
+
+                        edge_hits = 0;
+                        for (d = c; d < dfa->nclasses; d++) {
+                                if (dfa->trans[q * dfa->nclasses + d] == t)
+                                        edge_hits +=
+                                                hits[q * dfa->nclasses + d];
+                        }
+                        fprintf (out, " (%lu)\"", edge_hits);
+                        if (max_state)
+                                fprintf (out, ", penwidth=%.1f",
+                                         1 + 4.0 * edge_hits / max_state);
+                        fputs ("];\n", out);
+                }
+        }
+
+        fprintf (out, "}\n");
+
+        free (state_hits);
+        free (drawn);
+}
+
+
+/*
+ * Choosing the engine for one match, by the state visits each is
+ * expected to take:
+ *
+ *   nfa        every state, per byte                  len * nstates
+ *   dfa        its build, guessed at as many DFA states as NFA
+ *              states, each worked out per byte class  nstates^2 * classes
+ *              then one per byte                       + len
+ *   backtrack  the states a pebble spreads to, per byte len * width
+ *   onepass    one, per byte                           len
+ *
+ * where width is the most states one state reaches by E transitions.
+ * A one-pass RegExp, with its table built at compile time, is run by
+ * it whenever it can be. Counted repetitions leave only the nfa; so
+ * does a step limit, steps being visits of the pebble runs.
+ */
+
+#define BACKTRACK_MEMORY_MAX (16 << 20) /* its bit set, by default */
+
+
+const char *engine_names[] = { "auto", "nfa", "dfa", "backtrack",
+                               "onepass" };
+
+
+/* the engine called @name, -1 if none is */
+int
+engine_by_name (const char *name)
+{
+        int n = 0;
+
+        for (n = 0; n < (int) (sizeof (engine_names) /
+                               sizeof (*engine_names)); n++) {
+                if (!strcmp (name, engine_names[n]))
+                        return n;
+        }
+
+        return -1;
+}
+
+
+/* the most states any state of @regex reaches by E transitions */
+size_t
+engine_width (struct regex *regex)
+{
+        struct analysis    analysis = { .regex = regex };
+        struct transition *trav = NULL;
+        struct state      *each = NULL;
+        size_t             width = 0;
+        size_t             reach = 0;
+        int                depth = 0;
+        int                n = 0;
+
+        if (regex->nstates > REQUIRED_STATES_MAX)
+                return regex->nstates;
+
+        analysis.states = calloc (regex->nstates, sizeof (*analysis.states));
+        analysis.stack = calloc (regex->nstates, sizeof (*analysis.stack));
+        analysis.seen = calloc (regex->nstates, sizeof (*analysis.seen));
+        if (!analysis.states || !analysis.stack || !analysis.seen) {
+                width = regex->nstates;
+                goto out;
+        }
+
+        state_foreach (&regex->start, index_by_idx, &analysis);
+
+        for (n = 0; n < regex->nstates; n++) {
+                analysis.mark++;
+                analysis.seen[n] = analysis.mark;
+                analysis.stack[depth++] = n;
+                reach = 0;
+
+                while (depth) {
+                        each = analysis.states[analysis.stack[--depth]];
+                        reach++;
+
+                        for (trav = each->transitions; trav;
+                             trav = trav->next) {
+                                if (!is_E (trav->label) ||
+                                    analysis.seen[trav->to->idx] ==
+                                    analysis.mark)
+                                        continue;
+                                analysis.seen[trav->to->idx] = analysis.mark;
+                                analysis.stack[depth++] = trav->to->idx;
+                        }
+                }
+
+                if (reach > width)
+                        width = reach;
+        }
+
+out:
+        free (analysis.states);
+        free (analysis.stack);
+        free (analysis.seen);
+
+        return width;
+}
+
+
+/* can @engine match @len bytes with @regex in @mode at all? */
+int
+engine_can (struct regex *regex, engine_t engine, match_mode_t mode,
+            int search, size_t len, int stream,
+            const struct match_limits *limits)
+{
+        size_t memory = 0;
+
+        switch (engine) {
+        case ENGINE_DFA:
+                return !regex->counters && !limits->max_steps &&
+                        (search || mode == MATCH_FULL);
+
+        case ENGINE_BACKTRACK:
+                memory = limits->max_memory ? limits->max_memory :
+                        BACKTRACK_MEMORY_MAX;
+                return !regex->counters && !search && !stream &&
+                        (double) (len + 1) * regex->nstates / 8 <= memory;
+
+        case ENGINE_ONEPASS:
+                return regex->onepass && !limits->max_steps && !search &&
+                        !stream;
+
+        default:
+                return 1;
+        }
+}
+
+
+/*
+ * The engine to match @len bytes with @regex in @mode by, when that
+ * is left to ENGINE_AUTO, with the reason in @why. A @stream has no
+ * length known and is taken to be long; @threads asks for the DFA.
+ */
+engine_t
+engine_choose (struct regex *regex, match_mode_t mode, int search,
+               size_t len, int stream, int threads,
+               const struct match_limits *limits, const char **why)
+{
+        char   starts[257] = { 0, };
+        double nfa = 0;
+        double dfa = 0;
+        double backtrack = 0;
+        int    dfa_ok = 0;
+        int    backtrack_ok = 0;
+        int    classes = 0;
+        int    i = 0;
+
+        dfa_ok = engine_can (regex, ENGINE_DFA, mode, search, len, stream,
+                             limits);
+        backtrack_ok = !limits->max_steps &&
+                engine_can (regex, ENGINE_BACKTRACK, mode, search, len,
+                            stream, limits);
+
+        if (dfa_ok && regex->literals) {
+                *why = "a set of literal strings";
+                return ENGINE_DFA;
+        }
+        if (dfa_ok && threads) {
+                *why = "threads asked for";
+                return ENGINE_DFA;
+        }
+        if (engine_can (regex, ENGINE_ONEPASS, mode, search, len, stream,
+                        limits)) {
+                *why = "one-pass, one state per byte";
+                return ENGINE_ONEPASS;
+        }
+        if (search && regex->required && !dfa_ok) {
+                *why = "a required string to look for first";
+                return ENGINE_NFA;
+        }
+        if (dfa_ok && stream) {
+                *why = "input of unknown length";
+                return ENGINE_DFA;
+        }
+
+        state_foreach (&regex->start, mark_boundaries, starts);
+        for (i = 0; i < 256; i++)
+                classes += (i == 0 || starts[i]);
+
+        nfa = (double) len * (regex->nstates + regex->cwords);
+        dfa = (double) regex->nstates * regex->nstates * classes + len;
+        if (backtrack_ok)
+                backtrack = (double) len * engine_width (regex);
+
+        if (dfa_ok && dfa < nfa && (!backtrack_ok || dfa < backtrack)) {
+                *why = "input long for the pattern";
+                return ENGINE_DFA;
+        }
+        if (backtrack_ok && backtrack < nfa) {
+                *why = "few states reached per byte";
+                return ENGINE_BACKTRACK;
+        }
+
+        *why = regex->counters ? "counted repetitions" : "cheapest";
+        return ENGINE_NFA;
+}
+
+
+/*
+ * Reading input that is not mapped: READ_BUFFERS aligned buffers are
+ * kept being read into through io_uring while the matcher works on
+ * the one handed out, falling back to plain read() into one buffer
+ * where io_uring cannot be set up. Buffers are handed out in file
+ * order. Files that can be read at an offset have all of the buffers
+ * in flight at once; pipes and the like one at a time.
+ */
+
+#define READ_BUFFERS      4           /* reads kept in flight */
+#define READ_BUFFER_SIZE  (1 << 20)
+#define READ_ALIGN        4096
+
+
+typedef enum {
+        BUFFER_FREE,
+        BUFFER_READING,
+        BUFFER_READ,
+        BUFFER_HELD,     /* handed out */
+} buffer_state_t;
+
+
+struct read_buffer {
+        uint8_t           *data;
+        buffer_state_t     state;
+        uint64_t           off;         /* in the file */
+        size_t             want;
+        int                got;         /* bytes, or -errno */
+};
+
+
+struct reader {
+        int                fd;
+        int                seekable;
+        uint64_t           off;         /* of the next read */
+        int                eof;
+        int                reading;     /* reads in flight */
+        int                head;        /* next buffer to hand out */
+        int                tail;        /* next buffer to read into */
+        struct read_buffer buffers[READ_BUFFERS];
+
+        /* io_uring, ring_fd is -1 when using read() */
+        int                ring_fd;
+        void              *sq_ring;
+        size_t             sq_ring_size;
+        void              *cq_ring;
+        size_t             cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t             sqes_size;
+        unsigned          *sq_tail;
+        unsigned          *sq_mask;
+        unsigned          *sq_array;
+        unsigned          *cq_head;
+        unsigned          *cq_tail;
+        unsigned          *cq_mask;
+        struct io_uring_cqe *cqes;
+};
+
+
+int
+ring_setup (struct reader *reader)
+{
+        struct io_uring_params params;
+        int                    fd = -1;
+
+        memset (&params, 0, sizeof (params));
+
+        fd = syscall (__NR_io_uring_setup, READ_BUFFERS, &params);
+        if (fd < 0)
+                return -1;
+
+        reader->sq_ring_size = params.sq_off.array +
+                params.sq_entries * sizeof (unsigned);
+        reader->cq_ring_size = params.cq_off.cqes +
+                params.cq_entries * sizeof (struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (reader->cq_ring_size > reader->sq_ring_size)
+                        reader->sq_ring_size = reader->cq_ring_size;
+                reader->cq_ring_size = reader->sq_ring_size;
+        }
+
+        reader->sq_ring = mmap (NULL, reader->sq_ring_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd,
+                                IORING_OFF_SQ_RING);
+        if (reader->sq_ring == MAP_FAILED)
+                goto fail;
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                reader->cq_ring = reader->sq_ring;
+        } else {
+                reader->cq_ring = mmap (NULL, reader->cq_ring_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, fd,
+                                        IORING_OFF_CQ_RING);
+                if (reader->cq_ring == MAP_FAILED)
+                        goto unmap_sq;
+        }
+
+        reader->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+        reader->sqes = mmap (NULL, reader->sqes_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_SQES);
+        if (reader->sqes == MAP_FAILED)
+                goto unmap_cq;
+
+        reader->sq_tail = (void *) ((char *) reader->sq_ring +
+                                    params.sq_off.tail);
+        reader->sq_mask = (void *) ((char *) reader->sq_ring +
+                                    params.sq_off.ring_mask);
+        reader->sq_array = (void *) ((char *) reader->sq_ring +
+                                     params.sq_off.array);
+        reader->cq_head = (void *) ((char *) reader->cq_ring +
+                                    params.cq_off.head);
+        reader->cq_tail = (void *) ((char *) reader->cq_ring +
+                                    params.cq_off.tail);
+        reader->cq_mask = (void *) ((char *) reader->cq_ring +
+                                    params.cq_off.ring_mask);
+        reader->cqes = (void *) ((char *) reader->cq_ring +
+                                 params.cq_off.cqes);
+
+        reader->ring_fd = fd;
+
+        return 0;
+
+unmap_cq:
+        if (reader->cq_ring != reader->sq_ring)
+                munmap (reader->cq_ring, reader->cq_ring_size);
+unmap_sq:
+        munmap (reader->sq_ring, reader->sq_ring_size);
+fail:
+        close (fd);
+
+        return -1;
+}
+
+
+int
+ring_submit (struct reader *reader, int idx)
+{
+        struct read_buffer  *buffer = NULL;
+        struct io_uring_sqe *sqe = NULL;
+        unsigned             tail = 0;
+        unsigned             slot = 0;
+        int                  ret = 0;
+
+        buffer = &reader->buffers[idx];
+
+        tail = *reader->sq_tail;
+        slot = tail & *reader->sq_mask;
+        sqe = &reader->sqes[slot];
+
+        memset (sqe, 0, sizeof (*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = reader->fd;
+        sqe->addr = (uintptr_t) buffer->data;
+        sqe->len = buffer->want;
+        sqe->off = reader->seekable ? buffer->off : (uint64_t) -1;
+        sqe->user_data = idx;
+
+        reader->sq_array[slot] = slot;
+        __atomic_store_n (reader->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        do {
+                ret = syscall (__NR_io_uring_enter, reader->ring_fd, 1, 0, 0,
+                               NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0)
+                return -1;
+
+        buffer->state = BUFFER_READING;
+        reader->reading++;
+
+        return 0;
+}
+
+
+void
+ring_reap (struct reader *reader, int wait)
+{
+        struct io_uring_cqe *cqe = NULL;
+        struct read_buffer  *buffer = NULL;
+        unsigned             head = 0;
+
+        if (wait) {
+                while (syscall (__NR_io_uring_enter, reader->ring_fd, 0, 1,
+                                IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                       errno == EINTR)
+                        ;
+        }
+
+        head = *reader->cq_head;
+        while (head != __atomic_load_n (reader->cq_tail, __ATOMIC_ACQUIRE)) {
+                cqe = &reader->cqes[head & *reader->cq_mask];
+                buffer = &reader->buffers[cqe->user_data];
+                buffer->got = cqe->res;
+                buffer->state = BUFFER_READ;
+                reader->reading--;
+                head++;
+        }
+        __atomic_store_n (reader->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* start reads into the free buffers, in order */
+int
+reader_fill (struct reader *reader)
+{
+        struct read_buffer *buffer = NULL;
+
+        while (!reader->eof &&
+               reader->buffers[reader->tail].state == BUFFER_FREE &&
+               (reader->seekable || reader->reading == 0)) {
+                buffer = &reader->buffers[reader->tail];
+                buffer->off = reader->off;
+                buffer->want = READ_BUFFER_SIZE;
+
+                if (ring_submit (reader, reader->tail) != 0)
+                        return -1;
+
+                reader->off += READ_BUFFER_SIZE;
+                reader->tail = (reader->tail + 1) % READ_BUFFERS;
+        }
+
+        return 0;
+}
+
+
+int
+reader_open (struct reader *reader, int fd)
+{
+        struct stat st;
+        int         i = 0;
+
+        memset (reader, 0, sizeof (*reader));
+        reader->fd = fd;
+        reader->ring_fd = -1;
+        reader->seekable = (fstat (fd, &st) == 0 && S_ISREG (st.st_mode));
+
+        for (i = 0; i < READ_BUFFERS; i++) {
+                if (posix_memalign ((void **) &reader->buffers[i].data,
+                                    READ_ALIGN, READ_BUFFER_SIZE) != 0)
+                        return -1;
+        }
+
+        if (ring_setup (reader) != 0)
+                return 0; /* read() it is */
+
+        return reader_fill (reader);
+}
+
+
+void
+reader_close (struct reader *reader)
+{
+        int i = 0;
+
+        if (reader->ring_fd >= 0) {
+                /* reads still in flight write into the buffers */
+                while (reader->reading)
+                        ring_reap (reader, 1);
+
+                munmap (reader->sqes, reader->sqes_size);
+                if (reader->cq_ring != reader->sq_ring)
+                        munmap (reader->cq_ring, reader->cq_ring_size);
+                munmap (reader->sq_ring, reader->sq_ring_size);
+                close (reader->ring_fd);
+        }
+
+        for (i = 0; i < READ_BUFFERS; i++)
+                free (reader->buffers[i].data);
+}
+
+
+/*
+ * The next piece of the file, valid until the next call. Returns its
+ * length, 0 at the end of the file, -1 on errors.
+ */
+ssize_t
+reader_next (struct reader *reader, const uint8_t **data)
+{
+        struct read_buffer *buffer = NULL;
+        ssize_t             got = 0;
+
+        buffer = &reader->buffers[reader->head];
+
+        if (reader->ring_fd < 0) {
+                do {
+                        got = read (reader->fd, buffer->data,
+                                    READ_BUFFER_SIZE);
+                } while (got < 0 && errno == EINTR);
+
+                *data = buffer->data;
+                return got;
+        }
+
+        if (buffer->state == BUFFER_HELD) {
+                if (buffer->got < (int) buffer->want && reader->seekable) {
+                        /* short read, the rest of it is read next */
+                        buffer->off += buffer->got;
+                        buffer->want -= buffer->got;
+                        if (ring_submit (reader, reader->head) != 0)
+                                return -1;
+                } else {
+                        buffer->state = BUFFER_FREE;
+                        reader->head = (reader->head + 1) % READ_BUFFERS;
+                        buffer = &reader->buffers[reader->head];
+                }
+        }
+
+        if (reader_fill (reader) != 0)
+                return -1;
+
+        while (buffer->state == BUFFER_READING) {
+                ring_reap (reader, 1);
+                if (reader_fill (reader) != 0)
+                        return -1;
+        }
+
+        if (buffer->state != BUFFER_READ) /* nothing more was read */
+                return 0;
+
+        if (buffer->got <= 0) {
+                reader->eof = 1;
+                errno = -buffer->got;
+                return buffer->got ? -1 : 0;
+        }
+
+        buffer->state = BUFFER_HELD;
+        *data = buffer->data;
+
+        return buffer->got;
+}
+
+
+/*
+ * grep mode: print the lines of files that the RegExp matches
+ * anywhere in. Files are mapped a batch at a time and cut into line
+ * aligned chunks. The chunks of a batch are dealt out to the queues of
+ * the worker threads, an idle worker steals from the far end of the
+ * others' queues. The main thread prints the chunks in file order as
+ * they get done.
+ */
+
+#define GREP_CHUNK_SIZE   (1 << 20)   /* bytes of a file per task */
+#define GREP_BATCH_SIZE   (256 << 20) /* bytes mapped at a time */
+
+
+typedef enum {
+        GREP_LINES,      /* the matching lines */
+        GREP_COUNT,      /* how many lines matched, per file */
+        GREP_FILES,      /* the names of files with a matching line */
+} grep_output_t;
+
+
+struct grep_file {
+        char              *name;
+        uint8_t           *map;
+        size_t             size;
+        unsigned long      count;       /* lines matched */
+        int                hit;         /* GREP_FILES: stop looking */
+};
+
+
+struct grep_task {
+        struct grep_file  *file;
+        size_t             off;
+        size_t             len;
+        int                last;        /* of its file */
+        int                done;
+        unsigned long      count;       /* lines matched */
+        char              *out;         /* matching lines */
+        size_t             out_len;
+        size_t             out_size;
+};
+
+
+struct grep_queue {
+        pthread_mutex_t    lock;
+        struct grep_task **tasks;
+        int                head;        /* the owner takes from here */
+        int                tail;        /* and thieves from here */
+};
+
+
+struct grep {
+        struct regex      *regex;
+        struct dfa        *dfa;         /* if it could be built */
+        grep_output_t      output;
+        int                prefix;      /* print file names */
+        int                nthreads;
+        struct grep_queue *queues;
+        pthread_mutex_t    lock;        /* task->done */
+        pthread_cond_t     done;
+        int                nomem;
+};
+
+
+struct grep_worker {
+        struct grep       *grep;
+        int                id;
+        pthread_t          thread;
+};
+
+
+struct grep_task *
+grep_take (struct grep *grep, int id)
+{
+        struct grep_queue *queue = NULL;
+        struct grep_task  *task = NULL;
+        int                i = 0;
+
+        /* own queue first, oldest chunk first so printing can go on */
+        queue = &grep->queues[id];
+        pthread_mutex_lock (&queue->lock);
+        {
+                if (queue->head < queue->tail)
+                        task = queue->tasks[queue->head++];
+        }
+        pthread_mutex_unlock (&queue->lock);
+
+        for (i = 1; !task && i < grep->nthreads; i++) {
+                queue = &grep->queues[(id + i) % grep->nthreads];
+                pthread_mutex_lock (&queue->lock);
+                {
+                        if (queue->head < queue->tail)
+                                task = queue->tasks[--queue->tail];
+                }
+                pthread_mutex_unlock (&queue->lock);
+        }
+
+        return task;
+}
+
+
+int
+grep_output (struct grep *grep, struct grep_task *task, const uint8_t *line,
+             size_t len)
+{
+        size_t  name_len = 0;
+        size_t  need = 0;
+        size_t  size = 0;
+        char   *out = NULL;
+
+        if (grep->prefix)
+                name_len = strlen (task->file->name) + 1;
+
+        need = task->out_len + name_len + len + 1;
+        if (need > task->out_size) {
+                size = task->out_size ? task->out_size : 4096;
+                while (size < need)
+                        size *= 2;
+                out = realloc (task->out, size);
+                if (!out)
+                        return -1;
+                task->out = out;
+                task->out_size = size;
+        }
+
+        out = task->out + task->out_len;
+        if (name_len) {
+                memcpy (out, task->file->name, name_len - 1);
+                out[name_len - 1] = ':';
+        }
+        memcpy (out + name_len, line, len);
+        out[name_len + len] = '\n';
+        task->out_len = need;
+
+        return 0;
+}
+
+
+/* the first newline from @p on, or @end */
+const uint8_t *
+find_newline (const uint8_t *p, const uint8_t *end)
+{
+        const uint8_t *nl = NULL;
+
+        nl = memchr (p, '\n', end - p);
+
+        return nl ? nl : end;
+}
+
+
+/* does the RegExp match anywhere in @line? */
+int
+grep_line (struct grep *grep, struct run *run, const uint8_t *line,
+           size_t len)
+{
+        int state = 0;
+
+        /* cheaper to look for first, the DFA reads every byte */
+        if (grep->regex->required &&
+            required_find (grep->regex->required, line, len, 0) < 0)
+                return 0;
+
+        if (grep->dfa) {
+                state = dfa_scan (grep->dfa, grep->dfa->start, line, len);
+                return grep->dfa->is_final[state];
+        }
+
+        return search_run (run, line, len, NULL);
+}
+
+
+int
+grep_chunk (struct grep *grep, struct run *run, struct grep_task *task)
+{
+        const uint8_t *line = NULL;
+        const uint8_t *end = NULL;
+        const uint8_t *nl = NULL;
+
+        if (!task->len)
+                return 0;
+
+        /* another chunk of the file already had a hit */
+        if (grep->output == GREP_FILES &&
+            __atomic_load_n (&task->file->hit, __ATOMIC_RELAXED))
+                return 0;
+
+        line = task->file->map + task->off;
+        end = line + task->len;
+
+        while (line < end) {
+                nl = find_newline (line, end);
+
+                if (grep_line (grep, run, line, nl - line)) {
+                        task->count++;
+
+                        if (grep->output == GREP_FILES) {
+                                __atomic_store_n (&task->file->hit, 1,
+                                                  __ATOMIC_RELAXED);
+                                break;
+                        }
+
+                        if (grep->output == GREP_LINES &&
+                            grep_output (grep, task, line, nl - line) != 0)
+                                return -1;
+                }
+
+                line = nl + 1;
+        }
+
+        return 0;
+}
+
+
+void *
+grep_work (void *data)
+{
+        struct grep_worker *worker = NULL;
+        struct grep        *grep = NULL;
+        struct grep_task   *task = NULL;
+        struct run          run;
+        int                 ok = 0;
+        int                 ret = 0;
+
+        worker = data;
+        grep = worker->grep;
+
+        ok = (run_init (&run, grep->regex) == 0);
+
+        /* all the tasks of a batch are queued before the workers start,
+           so no task left anywhere means done */
+        while ((task = grep_take (grep, worker->id))) {
+                ret = ok ? grep_chunk (grep, &run, task) : -1;
+
+                pthread_mutex_lock (&grep->lock);
+                {
+                        if (ret != 0)
+                                grep->nomem = 1;
+                        task->done = 1;
+                        pthread_cond_broadcast (&grep->done);
+                }
+                pthread_mutex_unlock (&grep->lock);
+        }
+
+        if (ok)
+                run_fini (&run);
+
+        return NULL;
+}
+
+
+struct grep_list {
+        char             **names;
+        size_t             count;
+        size_t             size;
+};
+
+
+int
+grep_list_add (struct grep_list *list, const char *name)
+{
+        char **names = NULL;
+
+        if (list->count == list->size) {
+                list->size = list->size ? 2 * list->size : 64;
+                names = realloc (list->names,
+                                 list->size * sizeof (*names));
+                if (!names)
+                        return -1;
+                list->names = names;
+        }
+
+        list->names[list->count] = strdup (name);
+        if (!list->names[list->count])
+                return -1;
+        list->count++;
+
+        return 0;
+}
+
+
+int
+compare_names (const void *one, const void *two)
+{
+        return strcmp (*(char * const *) one, *(char * const *) two);
+}
+
+
+/*
+ * Add the regular files at @path to @list, those under it in name
+ * order if it is a directory. Symbolic links are followed only when
+ * given by name. Returns the number of paths that could not be read.
+ */
+int
+grep_collect (struct grep_list *list, const char *path, int given)
+{
+        struct grep_list  entries = { 0, };
+        struct dirent    *entry = NULL;
+        struct stat       st;
+        DIR              *dir = NULL;
+        char             *sub = NULL;
+        size_t            i = 0;
+        int               errors = 0;
+
+        if (given && !strcmp (path, "-"))
+                return grep_list_add (list, path) ? 1 : 0;
+
+        if ((given ? stat (path, &st) : lstat (path, &st)) != 0) {
+                fprintf (stderr, "%s: %s\n", path, strerror (errno));
+                return 1;
+        }
+
+        if (S_ISREG (st.st_mode))
+                return grep_list_add (list, path) ? 1 : 0;
+
+        if (!S_ISDIR (st.st_mode))
+                return 0;
+
+        dir = opendir (path);
+        if (!dir) {
+                fprintf (stderr, "%s: %s\n", path, strerror (errno));
+                return 1;
+        }
+
+        while ((entry = readdir (dir))) {
+                if (!strcmp (entry->d_name, ".") ||
+                    !strcmp (entry->d_name, ".."))
+                        continue;
+                if (grep_list_add (&entries, entry->d_name) != 0)
+                        errors++;
+        }
+        closedir (dir);
+
+        qsort (entries.names, entries.count, sizeof (*entries.names),
+               compare_names);
+
+        for (i = 0; i < entries.count; i++) {
+                sub = malloc (strlen (path) + strlen (entries.names[i]) + 2);
+                if (sub) {
+                        sprintf (sub, "%s/%s", path, entries.names[i]);
+                        errors += grep_collect (list, sub, 0);
+                } else {
+                        errors++;
+                }
+                free (sub);
+                free (entries.names[i]);
+        }
+        free (entries.names);
+
+        return errors;
+}
+
+
+int
+grep_map (struct grep_file *file)
+{
+        struct stat st;
+        int         fd = -1;
+
+        fd = open (file->name, O_RDONLY);
+        if (fd < 0 || fstat (fd, &st) != 0) {
+                fprintf (stderr, "%s: %s\n", file->name, strerror (errno));
+                if (fd >= 0)
+                        close (fd);
+                return -1;
+        }
+
+        file->size = st.st_size;
+        file->map = NULL;
+
+        if (file->size) {
+                file->map = mmap (NULL, file->size, PROT_READ, MAP_PRIVATE,
+                                  fd, 0);
+                if (file->map == MAP_FAILED) {
+                        fprintf (stderr, "%s: %s\n", file->name,
+                                 strerror (errno));
+                        file->map = NULL;
+                        close (fd);
+                        return -1;
+                }
+                madvise (file->map, file->size, MADV_SEQUENTIAL);
+        }
+
+        close (fd);
+
+        return 0;
+}
+
+
+/*
+ * Cut @file into line aligned chunks of about GREP_CHUNK_SIZE bytes,
+ * appending them to @tasks. Returns the new number of tasks.
+ */
+size_t
+grep_cut (struct grep_file *file, struct grep_task *tasks, size_t ntasks)
+{
+        const uint8_t *nl = NULL;
+        size_t         off = 0;
+        size_t         len = 0;
+
+        /* one task even for an empty file, it is counted too */
+        do {
+                len = file->size - off;
+                if (len > GREP_CHUNK_SIZE) {
+                        nl = memchr (file->map + off + GREP_CHUNK_SIZE, '\n',
+                                     len - GREP_CHUNK_SIZE);
+                        if (nl)
+                                len = nl + 1 - (file->map + off);
+                }
+
+                memset (&tasks[ntasks], 0, sizeof (tasks[ntasks]));
+                tasks[ntasks].file = file;
+                tasks[ntasks].off = off;
+                tasks[ntasks].len = len;
+                ntasks++;
+
+                off += len;
+        } while (off < file->size);
+
+        tasks[ntasks - 1].last = 1;
+
+        return ntasks;
+}
+
+
+/* the line printed for a whole file, in GREP_COUNT and GREP_FILES */
+void
+grep_summary (struct grep *grep, const char *name, unsigned long count)
+{
+        if (grep->output == GREP_COUNT && grep->prefix)
+                printf ("%s:%lu\n", name, count);
+        else if (grep->output == GREP_COUNT)
+                printf ("%lu\n", count);
+        else if (grep->output == GREP_FILES && count)
+                printf ("%s\n", name);
+}
+
+
+/*
+ * Run the tasks of one batch on the workers, printing them in order.
+ * Returns 1 if any line matched.
+ */
 int
-match_regex (struct state *state, const char *input)
+grep_batch (struct grep *grep, struct grep_task *tasks, size_t ntasks)
 {
-        int i = 0;
-        int ret = 0;
+        struct grep_worker *workers = NULL;
+        struct grep_queue  *queue = NULL;
+        size_t              i = 0;
+        int                 matched = 0;
+        int                 n = 0;
+
+        /* dealt round-robin, so the chunks printed next are being
+           worked on by all the threads */
+        for (n = 0; n < grep->nthreads; n++) {
+                grep->queues[n].head = 0;
+                grep->queues[n].tail = 0;
+        }
+        for (i = 0; i < ntasks; i++) {
+                queue = &grep->queues[i % grep->nthreads];
+                queue->tasks[queue->tail++] = &tasks[i];
+        }
+
+        workers = calloc (grep->nthreads, sizeof (*workers));
+        if (!workers)
+                return -1;
+
+        for (n = 0; n < grep->nthreads; n++) {
+                workers[n].grep = grep;
+                workers[n].id = n;
+                if (pthread_create (&workers[n].thread, NULL, grep_work,
+                                    &workers[n]) != 0)
+                        break;
+        }
+
+        if (n == 0) /* no threads at all, do it here */
+                grep_work (&(struct grep_worker) { .grep = grep });
+
+        for (i = 0; i < ntasks; i++) {
+                pthread_mutex_lock (&grep->lock);
+                {
+                        while (!tasks[i].done)
+                                pthread_cond_wait (&grep->done, &grep->lock);
+                }
+                pthread_mutex_unlock (&grep->lock);
+
+                if (tasks[i].out_len)
+                        fwrite (tasks[i].out, 1, tasks[i].out_len, stdout);
+                free (tasks[i].out);
+
+                tasks[i].file->count += tasks[i].count;
+                if (tasks[i].count)
+                        matched = 1;
+
+                if (tasks[i].last) {
+                        grep_summary (grep, tasks[i].file->name,
+                                      tasks[i].file->count);
+                        if (tasks[i].file->map)
+                                munmap (tasks[i].file->map,
+                                        tasks[i].file->size);
+                }
+        }
+
+        while (n--)
+                pthread_join (workers[n].thread, NULL);
+
+        free (workers);
+
+        return matched;
+}
+
+
+/*
+ * Make room for @need tasks in a batch, only when it is empty.
+ */
+int
+grep_grow (struct grep *grep, struct grep_task **tasks, size_t need)
+{
+        int n = 0;
+
+        free (*tasks);
+        *tasks = calloc (need, sizeof (**tasks));
+        if (!*tasks)
+                return -1;
+
+        for (n = 0; n < grep->nthreads; n++) {
+                free (grep->queues[n].tasks);
+                grep->queues[n].tasks = calloc (need,
+                                                sizeof (struct grep_task *));
+                if (!grep->queues[n].tasks)
+                        return -1;
+        }
+
+        return 0;
+}
+
+
+void
+grep_print (struct grep *grep, const char *name, const uint8_t *carry,
+            size_t carry_len, const uint8_t *line, size_t len)
+{
+        if (grep->prefix)
+                printf ("%s:", name);
+        if (carry_len)
+                fwrite (carry, 1, carry_len, stdout);
+        fwrite (line, 1, len, stdout);
+        putchar ('\n');
+}
+
+
+/* start matching a line that is fed to grep_feed() in pieces */
+void
+grep_begin (struct grep *grep, struct run *run, int *state)
+{
+        if (grep->dfa)
+                *state = grep->dfa->start;
+        else
+                run_begin (run, MATCH_PREFIX, 1, NULL);
+}
+
+
+/* the next @len bytes of the line, returns 1 once it matched */
+int
+grep_feed (struct grep *grep, struct run *run, int *state,
+           const uint8_t *buf, size_t len)
+{
+        if (grep->dfa) {
+                *state = dfa_scan (grep->dfa, *state, buf, len);
+                return grep->dfa->is_final[*state];
+        }
+
+        /* done may also mean no pebble is left: only a match counts */
+        run_feed (run, buf, len);
+
+        return run->ret == 1;
+}
+
+
+/*
+ * grep the input read from @fd on this thread. A line that runs on
+ * from one piece of the input into the next keeps its matcher state;
+ * what came of it so far is put aside only to be printed. Returns 1 if
+ * a line matched, 0 if not, -1 if out of memory, -2 if @fd could not
+ * be read.
+ */
+int
+grep_stream (struct grep *grep, struct run *run, const char *name, int fd)
+{
+        struct reader  reader;
+        const uint8_t *data = NULL;
+        const uint8_t *line = NULL;
+        const uint8_t *stop = NULL;
+        const uint8_t *nl = NULL;
+        uint8_t       *carry = NULL;
+        uint8_t       *more = NULL;
+        size_t         carry_len = 0;
+        size_t         carry_size = 0;
+        unsigned long  count = 0;
+        ssize_t        got = 0;
+        int            found = 0;
+        int            state = 0;
+        int            in_line = 0;
+
+        if (reader_open (&reader, fd) != 0) {
+                reader_close (&reader);
+                return -1;
+        }
+
+        grep_begin (grep, run, &state);
+
+        while ((got = reader_next (&reader, &data)) > 0) {
+                line = data;
+                stop = data + got;
+
+                while (line < stop) {
+                        nl = find_newline (line, stop);
+
+                        if (!found)
+                                found = grep_feed (grep, run, &state, line,
+                                                   nl - line);
+
+                        if (nl == stop) {
+                                in_line = 1;
+                                if (grep->output != GREP_LINES)
+                                        break;
+
+                                if (carry_len + (stop - line) > carry_size) {
+                                        carry_size = 2 * (carry_len +
+                                                          (stop - line));
+                                        more = realloc (carry, carry_size);
+                                        if (!more)
+                                                goto nomem;
+                                        carry = more;
+                                }
+                                memcpy (carry + carry_len, line, stop - line);
+                                carry_len += stop - line;
+                                break;
+                        }
+
+                        if (found && grep->output == GREP_LINES)
+                                grep_print (grep, name, carry, carry_len,
+                                            line, nl - line);
+                        count += found;
+
+                        if (found && grep->output == GREP_FILES)
+                                goto out;
+
+                        carry_len = 0;
+                        in_line = 0;
+                        found = 0;
+                        grep_begin (grep, run, &state);
+                        line = nl + 1;
+                }
+        }
+
+        /* the last line, with no newline */
+        if (got == 0 && in_line && found) {
+                if (grep->output == GREP_LINES)
+                        grep_print (grep, name, carry, carry_len,
+                                    carry + carry_len, 0);
+                count++;
+        }
+
+out:
+        if (got < 0)
+                fprintf (stderr, "%s: %s\n", name, strerror (errno));
+        else
+                grep_summary (grep, name, count);
+
+        free (carry);
+        reader_close (&reader);
+
+        return (got < 0) ? -2 : (count > 0);
+
+nomem:
+        free (carry);
+        reader_close (&reader);
+
+        return -1;
+}
+
+
+/*
+ * grep the files of @list one after the other, read instead of
+ * mapped. Returns 1 if a line matched, 0 if not, -1 if out of memory.
+ */
+int
+grep_read_all (struct grep *grep, struct grep_list *list, int *errors)
+{
+        struct run  run;
+        const char *name = NULL;
+        size_t      i = 0;
+        int         matched = 0;
+        int         ret = 0;
+        int         fd = -1;
+
+        if (run_init (&run, grep->regex) != 0)
+                return -1;
+
+        for (i = 0; i < list->count && ret != -1; i++) {
+                name = list->names[i];
+                if (!strcmp (name, "-")) {
+                        fd = 0;
+                        name = "(standard input)";
+                } else {
+                        fd = open (name, O_RDONLY);
+                }
+
+                if (fd < 0) {
+                        fprintf (stderr, "%s: %s\n", name, strerror (errno));
+                        (*errors)++;
+                        continue;
+                }
+
+                ret = grep_stream (grep, &run, name, fd);
+                if (ret == -2)
+                        (*errors)++;
+                else if (ret == 1)
+                        matched = 1;
+
+                if (fd)
+                        close (fd);
+        }
+
+        run_fini (&run);
+
+        return (ret == -1) ? -1 : matched;
+}
+
+
+/*
+ * grep for @regex in the files at @paths with @nthreads threads, or
+ * read one after the other with @stream or when "-", the standard
+ * input, is one of them. Lines are matched on the search DFA when it
+ * can be built. Returns 0 if some line matched, 1 if none did, 2 on
+ * errors, like grep(1).
+ */
+int
+grep_main (struct regex *regex, char **paths, int npaths, int stream,
+           grep_output_t output, int nthreads)
+{
+        struct grep        grep = { .regex = regex, .nthreads = nthreads,
+                                    .output = output };
+        struct grep_list   list = { 0, };
+        struct grep_file  *files = NULL;
+        struct grep_task  *tasks = NULL;
+        size_t             max_tasks = 0;
+        size_t             ntasks = 0;
+        size_t             batch = 0;
+        size_t             need = 0;
+        size_t             next = 0;
+        size_t             i = 0;
+        int                errors = 0;
+        int                matched = 0;
+        int                ret = 0;
+        int                n = 0;
+
+        for (n = 0; n < npaths; n++)
+                errors += grep_collect (&list, paths[n], 1);
+
+        grep.prefix = (list.count > 1 || npaths > 1);
+        grep.dfa = dfa_build (regex, 1, DFA_MEMORY_MAX);
+
+        for (i = 0; i < list.count; i++)
+                stream |= !strcmp (list.names[i], "-");
+
+        if (stream) {
+                ret = grep_read_all (&grep, &list, &errors);
+                if (ret < 0)
+                        goto nomem;
+                matched = ret;
+                goto out;
+        }
+
+        files = calloc (list.count + 1, sizeof (*files));
+        grep.queues = calloc (nthreads, sizeof (*grep.queues));
+        if (!files || !grep.queues)
+                goto nomem;
+
+        /* a batch is up to GREP_BATCH_SIZE bytes, or one larger file */
+        max_tasks = GREP_BATCH_SIZE / GREP_CHUNK_SIZE + 1;
+        tasks = calloc (max_tasks, sizeof (*tasks));
+        if (!tasks)
+                goto nomem;
+
+        for (n = 0; n < nthreads; n++) {
+                pthread_mutex_init (&grep.queues[n].lock, NULL);
+                grep.queues[n].tasks = calloc (max_tasks,
+                                               sizeof (struct grep_task *));
+                if (!grep.queues[n].tasks)
+                        goto nomem;
+        }
+        pthread_mutex_init (&grep.lock, NULL);
+        pthread_cond_init (&grep.done, NULL);
+
+        while (next < list.count) {
+                ntasks = 0;
+                batch = 0;
+
+                for (; next < list.count; next++) {
+                        if (!files[next].name) {
+                                files[next].name = list.names[next];
+                                if (grep_map (&files[next]) != 0) {
+                                        errors++;
+                                        continue;
+                                }
+                        }
+
+                        /* left mapped for the next batch */
+                        need = files[next].size / GREP_CHUNK_SIZE + 1;
+                        if (ntasks && (batch + files[next].size >
+                                       GREP_BATCH_SIZE ||
+                                       ntasks + need > max_tasks))
+                                break;
+
+                        if (need > max_tasks &&
+                            grep_grow (&grep, &tasks, need) != 0)
+                                goto nomem;
+                        max_tasks = (need > max_tasks) ? need : max_tasks;
 
-        state_foreach (state, place_pebble_if_start, NULL);
-        state_foreach (state, commit_pebble, NULL);
+                        batch += files[next].size;
+                        ntasks = grep_cut (&files[next], tasks, ntasks);
+                }
+
+                ret = grep_batch (&grep, tasks, ntasks);
+                if (ret < 0 || grep.nomem)
+                        goto nomem;
+                matched |= ret;
+        }
+
+out:
+        for (n = 0; grep.queues && n < nthreads; n++) {
+                free (grep.queues[n].tasks);
+        }
+        for (i = 0; i < list.count; i++)
+                free (list.names[i]);
+        free (list.names);
+        free (grep.queues);
+        free (files);
+        free (tasks);
+        if (grep.dfa)
+                dfa_free (grep.dfa);
+
+        if (errors)
+                return 2;
+
+        return matched ? 0 : 1;
+
+nomem:
+        fprintf (stderr, "RegExp grep is out of memory\n");
+        errors++;
+        goto out;
+}
+
+
+/*
+ * Match the input read from @fd, on @dfa if not NULL, carrying the
+ * matcher state from one piece of it to the next. Returns like
+ * match_regex().
+ */
+int
+match_stream (struct regex *regex, struct dfa *dfa, int fd,
+              match_mode_t mode, int search,
+              const struct match_limits *limits, size_t *end)
+{
+        struct reader  reader;
+        struct run     run;
+        const uint8_t *data = NULL;
+        ssize_t        got = 0;
+        int            state = 0;
+        int            ret = 0;
+
+        if (reader_open (&reader, fd) != 0) {
+                reader_close (&reader);
+                return MATCH_ERR_NOMEM;
+        }
 
-        for (i = 0; i < strlen (input); i++) {
-                state_foreach (state, move_pebble, (void *) &input[i]);
-                state_foreach (state, commit_pebble, NULL);
+        if (dfa) {
+                state = dfa->start;
+                while ((got = reader_next (&reader, &data)) > 0) {
+                        state = dfa_scan (dfa, state, data, got);
+                        if (state == DFA_DEAD ||
+                            (dfa->search && dfa->is_final[state]))
+                                break;
+                }
+                ret = dfa->is_final[state];
+        } else if (run_init (&run, regex) == 0) {
+                run_begin (&run, search ? MATCH_PREFIX : mode, search,
+                           limits);
+                while ((got = reader_next (&reader, &data)) > 0 &&
+                       !run_feed (&run, data, got))
+                        ;
+                ret = run_end (&run, end);
+                run_fini (&run);
+        } else {
+                ret = MATCH_ERR_NOMEM;
         }
 
-        ret = state_foreach (state, pebble_in_final, NULL);
+        if (got < 0)
+                ret = MATCH_ERR_READ;
+
+        reader_close (&reader);
 
         return ret;
 }
 
 
+/*
+ * Match against one input, the string @input or, with @mapped, the
+ * file of that name ("-" is the standard input), read instead of
+ * mapped with @stream. With @search the match may be anywhere in it.
+ * Run by @engine, or the one engine_choose() picks for ENGINE_AUTO,
+ * told on stderr with @report. Given @nthreads, full and search
+ * matches are run on the DFA on that many threads if it can be built.
+ */
 int
-main (int argc, char *argv[])
+match_main (struct regex *compiled, const char *regex, const char *input,
+            match_mode_t mode, int search, int mapped, int stream,
+            int nthreads, engine_t engine, int report,
+            const struct match_limits *limits)
 {
-        char *regex = NULL;
-        char *input = NULL;
+        const char       *why = "asked for";
+        struct grep_file  file = { .name = (char *) input };
+        struct dfa       *dfa = NULL;
+        const uint8_t    *buf = NULL;
+        size_t            len = 0;
+        size_t            end = 0;
+        size_t            max_size = 0;
+        int               ret = 0;
+        int               fd = -1;
+
+        stream = mapped && (stream || !strcmp (input, "-"));
+
+        if (stream) {
+                fd = strcmp (input, "-") ? open (input, O_RDONLY) : 0;
+                if (fd < 0) {
+                        fprintf (stderr, "%s: %s\n", input,
+                                 strerror (errno));
+                        return 2;
+                }
+        } else if (mapped) {
+                if (grep_map (&file) != 0)
+                        return 2;
+                buf = file.map;
+                len = file.size;
+        } else {
+                buf = (const uint8_t *) input;
+                len = strlen (input);
+        }
 
-        /* Hardcoded start state, to kick-start */
-        struct state start = {
-                .next        = &start,
-                .prev        = &start,
-                .id          = 0,
-                .is_start    = 1,
-                .is_final    = 1,
-                .transitions = NULL,
-        };
-
-        if (argc != 3) {
-                fprintf (stderr, "Usage: %s <regex> <input>\n",
-                         argv[0]);
-                return 1;
+        max_size = limits->max_memory ? limits->max_memory : DFA_MEMORY_MAX;
+
+        if (engine == ENGINE_AUTO) {
+                engine = engine_choose (compiled, mode, search, len, stream,
+                                        nthreads > 0, limits, &why);
+        } else if (!engine_can (compiled, engine, mode, search, len, stream,
+                                limits)) {
+                why = "the one asked for cannot match this";
+                engine = ENGINE_NFA;
         }
 
-        regex = argv[1];
-        input = argv[2];
+        if (limits->max_states && compiled->nstates > limits->max_states) {
+                ret = MATCH_ERR_STATES;
+        } else if (engine == ENGINE_DFA) {
+                dfa = dfa_build (compiled, search, max_size);
+                if (!dfa) {
+                        why = "no DFA within the memory budget";
+                        engine = ENGINE_NFA;
+                }
+        }
 
-        if (parse_regex (&start, regex) != 0) {
-                return 1;
+        if (report)
+                fprintf (stderr, "RegExp engine: %s, %s\n",
+                         engine_names[engine], why);
+
+        if (ret) {
+                ;
+        } else if (engine == ENGINE_BACKTRACK) {
+                ret = backtrack_match (compiled, buf, len, mode, limits,
+                                       &end);
+        } else if (engine == ENGINE_ONEPASS) {
+                ret = onepass_match (compiled, buf, len, mode, &end);
+        } else if (stream) {
+                ret = match_stream (compiled, dfa, fd, mode, search, limits,
+                                    &end);
+        } else if (dfa) {
+                ret = dfa_match (dfa, buf, len, nthreads);
+                end = len;
+        } else if (search) {
+                ret = search_regex (compiled, buf, len, limits);
+                end = len;
+        } else {
+                ret = match_regex (compiled, buf, len, mode, limits, &end);
+        }
+
+        if (dfa)
+                dfa_free (dfa);
+        if (fd > 0)
+                close (fd);
+        if (file.map)
+                munmap (file.map, file.size);
+
+        if (ret < 0) {
+                fprintf (stderr, "RegExp gave up: %s\n",
+                         match_strerror (ret));
+                return 2;
         }
 
-        if (match_regex (&start, input) == 1) {
+        if (ret == 1 && mapped && !search && mode != MATCH_FULL)
+                printf ("%s accepts the first %zu bytes of %s\n", regex, end,
+                        input);
+        else if (ret == 1 && mapped)
                 printf ("%s accepts %s\n", regex, input);
-        } else {
+        else if (ret == 1)
+                printf ("%s accepts %.*s\n", regex, (int) end, input);
+        else
                 printf ("%s does not accept %s\n", regex, input);
+
+        return 0;
+}
+
+
+/*
+ * Match each line of @path, "-" for the standard input, a RegExp and
+ * an input separated by a tab, as match_main() would. The RegExps are
+ * compiled through a cache of @cache_size bytes, how well it did goes
+ * to stderr at the end. Returns 2 if a line could not be matched.
+ */
+int
+batch_main (const char *path, match_mode_t mode, int search, int flags,
+            size_t cache_size, const struct match_limits *limits)
+{
+        struct regex_cache       *cache = NULL;
+        struct regex_cache_stats  stats;
+        struct regex             *compiled = NULL;
+        FILE                     *in = NULL;
+        char                     *line = NULL;
+        char                     *input = NULL;
+        size_t                    size = 0;
+        ssize_t                   len = 0;
+        unsigned long             n = 0;
+        int                       ret = 0;
+
+        in = strcmp (path, "-") ? fopen (path, "r") : stdin;
+        if (!in) {
+                fprintf (stderr, "%s: %s\n", path, strerror (errno));
+                return 2;
+        }
+
+        cache = regex_cache_new (cache_size);
+        if (!cache) {
+                fprintf (stderr, "RegExp cache: %s\n", strerror (ENOMEM));
+                if (in != stdin)
+                        fclose (in);
+                return 2;
+        }
+
+        while ((len = getline (&line, &size, in)) != -1) {
+                n++;
+                if (len && line[len - 1] == '\n')
+                        line[--len] = '\0';
+
+                input = strchr (line, '\t');
+                if (!input) {
+                        fprintf (stderr, "%s:%lu: no tab after the RegExp\n",
+                                 path, n);
+                        ret = 2;
+                        continue;
+                }
+                *input++ = '\0';
+
+                compiled = regex_cache_get (cache, (const uint8_t *) line,
+                                            input - 1 - line, flags);
+                if (!compiled) {
+                        ret = 2;
+                        continue;
+                }
+
+                if (match_main (compiled, line, input, mode, search, 0, 0, 0,
+                                ENGINE_AUTO, 0, limits) != 0)
+                        ret = 2;
+                regex_unref (compiled);
+        }
+
+        regex_cache_stats (cache, &stats);
+        fprintf (stderr, "RegExp cache: %lu hits, %lu misses, %lu evicted, "
+                 "%zu kept in %zu bytes\n", stats.hits, stats.misses,
+                 stats.evictions, stats.entries, stats.size);
+
+        regex_cache_destroy (cache);
+        free (line);
+        if (in != stdin)
+                fclose (in);
+
+        return ret;
+}
+
+
+/*
+ * Keep a document, empty at first, edited by each line of @path, "-"
+ * for the standard input: "<at> <removed> <text>" replaces @removed
+ * bytes at @at by the rest of the line. After each edit, whether
+ * @compiled matches all of it, or with @search anywhere in it, is
+ * printed, from checkpoints_edit() on its DFA. Returns 2 on errors.
+ */
+int
+edits_main (struct regex *compiled, const char *regex, const char *path,
+            int search, const struct match_limits *limits)
+{
+        struct checkpoints *cps = NULL;
+        struct dfa         *dfa = NULL;
+        FILE               *in = NULL;
+        char               *line = NULL;
+        char               *p = NULL;
+        char               *q = NULL;
+        uint8_t            *doc = NULL;
+        uint8_t            *more = NULL;
+        size_t              doc_len = 0;
+        size_t              doc_size = 0;
+        size_t              size = 0;
+        size_t              max_size = 0;
+        size_t              at = 0;
+        size_t              removed = 0;
+        size_t              added = 0;
+        ssize_t             len = 0;
+        unsigned long       n = 0;
+        int                 ret = 0;
+        int                 got = 0;
+
+        max_size = limits->max_memory ? limits->max_memory : DFA_MEMORY_MAX;
+
+        dfa = dfa_build (compiled, search, max_size);
+        if (!dfa) {
+                fprintf (stderr, "RegExp has counters or its DFA is over "
+                         "%zu bytes\n", max_size);
+                return 2;
+        }
+
+        in = strcmp (path, "-") ? fopen (path, "r") : stdin;
+        if (!in) {
+                fprintf (stderr, "%s: %s\n", path, strerror (errno));
+                dfa_free (dfa);
+                return 2;
+        }
+
+        cps = checkpoints_new (dfa, doc, 0);
+        if (!cps)
+                goto nomem;
+
+        while ((len = getline (&line, &size, in)) != -1) {
+                n++;
+                if (len && line[len - 1] == '\n')
+                        line[--len] = '\0';
+
+                at = strtoul (line, &p, 10);
+                removed = (*p == ' ') ? strtoul (p + 1, &q, 10) : 0;
+                if (*p != ' ' || q == p + 1 || (*q != ' ' && *q != '\0')) {
+                        fprintf (stderr, "%s:%lu: not <at> <removed> "
+                                 "<text>\n", path, n);
+                        ret = 2;
+                        continue;
+                }
+                if (*q == ' ')
+                        q++;
+                added = line + len - q;
+
+                if (at > doc_len || removed > doc_len - at) {
+                        fprintf (stderr, "%s:%lu: past the end of the "
+                                 "document\n", path, n);
+                        ret = 2;
+                        continue;
+                }
+
+                if (doc_len - removed + added > doc_size) {
+                        doc_size = 2 * (doc_len - removed + added);
+                        more = realloc (doc, doc_size);
+                        if (!more)
+                                goto nomem;
+                        doc = more;
+                }
+                memmove (doc + at + added, doc + at + removed,
+                         doc_len - at - removed);
+                memcpy (doc + at, q, added);
+                doc_len = doc_len - removed + added;
+
+                got = checkpoints_edit (cps, doc, doc_len, at, removed,
+                                        added);
+                if (got < 0)
+                        goto nomem;
+
+                printf ("%s %s edit %lu\n", regex,
+                        got ? "accepts" : "does not accept", n);
+        }
+
+out:
+        if (cps)
+                checkpoints_free (cps);
+        dfa_free (dfa);
+        free (doc);
+        free (line);
+        if (in != stdin)
+                fclose (in);
+
+        return ret;
+
+nomem:
+        fprintf (stderr, "RegExp is out of memory\n");
+        ret = 2;
+        goto out;
+}
+
+
+/*
+ * Match the flows of the packets in @path, "-" for the standard input,
+ * each on a line as "<flow> <bytes>", with a flow numbered from 0 and
+ * the rest of the line its bytes. The packets up to a blank line are a
+ * batch for flows_feed(). At the end, whether @compiled matches all of
+ * each flow, or with @search anywhere in it, is printed, flow by flow.
+ * Returns 2 on errors.
+ */
+int
+flows_main (struct regex *compiled, const char *regex, const char *path,
+            int search, const struct match_limits *limits)
+{
+        struct dfa     *dfa = NULL;
+        FILE           *in = NULL;
+        flow_t         *flows = NULL;
+        flow_t         *more_flows = NULL;
+        flow_t          first = 0;
+        size_t         *ids = NULL;
+        size_t         *lens = NULL;
+        uint8_t       **bufs = NULL;
+        void           *more = NULL;
+        char           *line = NULL;
+        char           *p = NULL;
+        size_t          nflows = 0;
+        size_t          npackets = 0;
+        size_t          room = 0;
+        size_t          size = 0;
+        size_t          max_size = 0;
+        size_t          id = 0;
+        size_t          i = 0;
+        ssize_t         len = 0;
+        unsigned long   n = 0;
+        int             ret = 0;
+
+        max_size = limits->max_memory ? limits->max_memory : DFA_MEMORY_MAX;
+
+        dfa = dfa_build (compiled, search, max_size);
+        if (!dfa) {
+                fprintf (stderr, "RegExp has counters or its DFA is over "
+                         "%zu bytes\n", max_size);
+                return 2;
+        }
+        if (flow_start (dfa, &first) != 0) {
+                fprintf (stderr, "RegExp has too many DFA states for a "
+                         "flow\n");
+                dfa_free (dfa);
+                return 2;
+        }
+
+        in = strcmp (path, "-") ? fopen (path, "r") : stdin;
+        if (!in) {
+                fprintf (stderr, "%s: %s\n", path, strerror (errno));
+                dfa_free (dfa);
+                return 2;
+        }
+
+        for (;;) {
+                len = getline (&line, &size, in);
+                n++;
+                if (len > 0 && line[len - 1] == '\n')
+                        line[--len] = '\0';
+
+                /* a blank line or the end: feed the batch */
+                if (len <= 0) {
+                        if (flows_feed (dfa, flows, ids,
+                                        (const uint8_t *const *) bufs, lens,
+                                        npackets) != 0)
+                                goto nomem;
+                        for (i = 0; i < npackets; i++)
+                                free (bufs[i]);
+                        npackets = 0;
+
+                        if (len < 0)
+                                break;
+                        continue;
+                }
+
+                id = strtoul (line, &p, 10);
+                if (p == line || (*p != ' ' && *p != '\0')) {
+                        fprintf (stderr, "%s:%lu: not <flow> <bytes>\n",
+                                 path, n);
+                        ret = 2;
+                        continue;
+                }
+                if (*p == ' ')
+                        p++;
+
+                if (id >= nflows) {
+                        more_flows = realloc (flows, (id + 1) *
+                                              sizeof (*flows));
+                        if (!more_flows)
+                                goto nomem;
+                        flows = more_flows;
+                        for (; nflows <= id; nflows++)
+                                flows[nflows] = first;
+                }
+
+                if (npackets == room) {
+                        room = room ? 2 * room : 64;
+                        more = realloc (ids, room * sizeof (*ids));
+                        if (!more)
+                                goto nomem;
+                        ids = more;
+                        more = realloc (lens, room * sizeof (*lens));
+                        if (!more)
+                                goto nomem;
+                        lens = more;
+                        more = realloc (bufs, room * sizeof (*bufs));
+                        if (!more)
+                                goto nomem;
+                        bufs = more;
+                }
+
+                bufs[npackets] = (uint8_t *) strdup (p);
+                if (!bufs[npackets])
+                        goto nomem;
+                ids[npackets] = id;
+                lens[npackets++] = line + len - p;
+        }
+
+        for (id = 0; id < nflows; id++)
+                printf ("%s %s flow %zu, %llu bytes\n", regex,
+                        flow_match (dfa, flows[id]) ? "accepts" :
+                        "does not accept", id,
+                        (unsigned long long) flow_offset (flows[id]));
+
+out:
+        for (i = 0; i < npackets; i++)
+                free (bufs[i]);
+        free (bufs);
+        free (lens);
+        free (ids);
+        free (flows);
+        dfa_free (dfa);
+        free (line);
+        if (in != stdin)
+                fclose (in);
+
+        return ret;
+
+nomem:
+        fprintf (stderr, "RegExp is out of memory\n");
+        ret = 2;
+        goto out;
+}
+
+
+/*
+ * Print @compiled as a Graphviz digraph, its NFA or with @dfa its
+ * DFA, with the counts of matching @input as match_main() would.
+ */
+int
+dot_main (struct regex *compiled, const char *input, match_mode_t mode,
+          int search, int mapped, int dfa, const struct match_limits *limits)
+{
+        struct grep_file  file = { .name = (char *) input };
+        struct profile   *profile = NULL;
+        struct dfa       *built = NULL;
+        unsigned long    *hits = NULL;
+        struct run        run;
+        const uint8_t    *buf = NULL;
+        size_t            len = 0;
+        size_t            end = 0;
+        size_t            max_size = 0;
+        int               ret = 0;
+
+        if (mapped) {
+                if (grep_map (&file) != 0)
+                        return 2;
+                buf = file.map;
+                len = file.size;
+        } else {
+                buf = (const uint8_t *) input;
+                len = strlen (input);
+        }
+
+        max_size = limits->max_memory ? limits->max_memory : DFA_MEMORY_MAX;
+
+        if (dfa) {
+                built = dfa_build (compiled, search, max_size);
+                if (!built) {
+                        fprintf (stderr, "RegExp has counters or its DFA "
+                                 "is over %zu bytes\n", max_size);
+                        ret = 2;
+                        goto out;
+                }
+
+                hits = calloc ((size_t) built->nstates * built->nclasses,
+                               sizeof (*hits));
+                if (!hits)
+                        goto nomem;
+
+                dfa_profile (built, buf, len, hits);
+                dfa_dot (built, hits, stdout);
+        } else {
+                profile = profile_new (compiled);
+                if (!profile || run_init (&run, compiled) != 0)
+                        goto nomem;
+
+                /* a match that gives up still shows where it went */
+                run.profile = profile;
+                run_begin (&run, mode, search, limits);
+                run_feed (&run, buf, len);
+                ret = run_end (&run, &end);
+                run_fini (&run);
+
+                regex_dot (compiled, profile, stdout);
+                if (ret < 0) {
+                        fprintf (stderr, "RegExp gave up: %s\n",
+                                 match_strerror (ret));
+                        ret = 2;
+                } else {
+                        ret = 0;
+                }
+        }
+
+out:
+        if (profile)
+                profile_free (profile);
+        if (built)
+                dfa_free (built);
+        free (hits);
+        if (file.map)
+                munmap (file.map, file.size);
+
+        return ret;
+
+nomem:
+        fprintf (stderr, "RegExp is out of memory\n");
+        ret = 2;
+        goto out;
+}
+
+
+/*
+ * The number given to option @opt, in @arg: decimal, or hex or octal
+ * as strtoul() reads them, and at most @max. Anything else, a sign or
+ * trailing junk included, is an error. Returns 0 if @value was set.
+ */
+int
+option_number (int opt, const char *arg, unsigned long max,
+               unsigned long *value)
+{
+        char *end = NULL;
+
+        errno = 0;
+        if (*arg >= '0' && *arg <= '9')
+                *value = strtoul (arg, &end, 0);
+
+        if (!end || *end || errno || *value > max) {
+                fprintf (stderr, "RegExp option -%c wants a number from 0 "
+                         "to %lu, not \"%s\"\n", opt, max, arg);
+                return -1;
         }
 
         return 0;
 }
+
+
+int
+main (int argc, char *argv[])
+{
+        char         *regex = NULL;
+        char         *input = NULL;
+        struct regex *compiled = NULL;
+        match_mode_t  mode = MATCH_FULL;
+        grep_output_t output = GREP_LINES;
+        size_t        cache_size = REGEX_CACHE_SIZE;
+        unsigned long number = 0;
+        int           flags = 0;
+        int           opt = 0;
+        int           batch = 0;
+        int           ret = 0;
+        int           grep = 0;
+        int           search = 0;
+        int           mapped = 0;
+        int           stream = 0;
+        int           nthreads = 0;
+        int           dot = 0;
+        int           dot_dfa = 0;
+        int           edits = 0;
+        int           flows = 0;
+        int           report = 0;
+        int           engine = ENGINE_AUTO;
+
+        struct match_limits limits = { 0, };
+
+        while ((opt = getopt (argc, argv, "fpslcLaumrigdDbEFe:j:C:S:M:N:")) != -1) {
+                switch (opt) {
+                case 'g': grep = 1; break;
+                case 'd': dot = 1; break;
+                case 'D': dot = 1; dot_dfa = 1; break;
+                case 'b': batch = 1; break;
+                case 'E': edits = 1; break;
+                case 'F': flows = 1; break;
+                case 'a': search = 1; break;
+                case 'm': mapped = 1; break;
+                case 'r': stream = 1; break;
+                case 'j':
+                        if (option_number (opt, optarg, INT_MAX, &number))
+                                return 2;
+                        nthreads = number;
+                        break;
+                case 'C':
+                        if (option_number (opt, optarg, SIZE_MAX, &number))
+                                return 2;
+                        cache_size = number;
+                        break;
+                case 'e':
+                        engine = engine_by_name (optarg);
+                        report = 1;
+                        if (engine < 0)
+                                argc = 0;
+                        break;
+                case 'S':
+                        if (option_number (opt, optarg, ULONG_MAX, &number))
+                                return 2;
+                        limits.max_steps = number;
+                        break;
+                case 'M':
+                        if (option_number (opt, optarg, SIZE_MAX, &number))
+                                return 2;
+                        limits.max_memory = number;
+                        break;
+                case 'N':
+                        if (option_number (opt, optarg, INT_MAX, &number))
+                                return 2;
+                        limits.max_states = number;
+                        break;
+                case 'u': flags |= REGEX_UTF8; break;
+                case 'i': flags |= REGEX_ICASE; break;
+                case 'f': mode = MATCH_FULL; break;
+                case 'p': mode = MATCH_PREFIX; break;
+                case 's': mode = MATCH_SHORTEST; break;
+                case 'l': mode = MATCH_LONGEST; break;
+                case 'c': output = GREP_COUNT; break;
+                case 'L': output = GREP_FILES; break;
+                default:
+                        argc = 0;
+                }
+        }
+
+        if ((batch && argc - optind != 1) ||
+            (!batch && argc - optind < 2) ||
+            (!batch && !grep && argc - optind != 2)) {
+                fprintf (stderr,
+                         "Usage: %s [-f|-p|-s|-l|-a] [-u] [-i] [-m [-r]] "
+                         "[-j threads] [-e engine] [-S steps] [-M bytes] "
+                         "[-N states] <regex> <input>\n"
+                         "       %s -g [-c|-L] [-u] [-i] [-r] [-j threads] "
+                         "<regex> <file|dir>...\n"
+                         "       %s -d|-D [-f|-p|-s|-l|-a] [-u] [-i] [-m] "
+                         "<regex> <input>\n"
+                         "       %s -b [-f|-p|-s|-l|-a] [-u] [-i] "
+                         "[-C bytes] <file>\n"
+                         "       %s -E [-a] [-u] [-i] [-M bytes] "
+                         "<regex> <edits>\n"
+                         "       %s -F [-a] [-u] [-i] [-M bytes] "
+                         "<regex> <packets>\n",
+                         argv[0], argv[0], argv[0], argv[0], argv[0],
+                         argv[0]);
+                return grep ? 2 : 1;
+        }
+
+        if (batch)
+                return batch_main (argv[optind], mode, search, flags,
+                                   cache_size, &limits);
+
+        regex = argv[optind];
+        input = argv[optind + 1];
+
+        compiled = regex_compile ((const uint8_t *) regex, strlen (regex),
+                                  flags);
+        if (!compiled) {
+                return grep ? 2 : 1;
+        }
+
+        if (grep) {
+                if (nthreads <= 0)
+                        nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+                if (nthreads <= 0)
+                        nthreads = 1;
+
+                ret = grep_main (compiled, argv + optind + 1,
+                                 argc - optind - 1, stream, output, nthreads);
+                regex_unref (compiled);
+
+                return ret;
+        }
+
+        if (edits)
+                ret = edits_main (compiled, regex, input, search, &limits);
+        else if (flows)
+                ret = flows_main (compiled, regex, input, search, &limits);
+        else if (dot)
+                ret = dot_main (compiled, input, mode, search, mapped,
+                                dot_dfa, &limits);
+        else
+                ret = match_main (compiled, regex, input, mode, search,
+                                  mapped, stream, nthreads, engine, report,
+                                  &limits);
+        regex_unref (compiled);
+
+        return ret;
+}
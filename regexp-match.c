@@ -5,11 +5,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
-/* define this when all constructs are E-loop free */
-#define MISERIES_IN_LIFE_ARE_SOLVED
-#define DEPTH_OF_MISERY 43
+#define STATES_MAX        100000  /* most states a RegExp may compile to */
+#define REPEAT_MAX        65535   /* largest count in {n,m} */
+#define REPEAT_UNROLL_MAX 8       /* larger {n,m} use a counter */
+
+#define REGEX_UTF8        0x1     /* symbols are UTF-8 characters */
+#define REGEX_ICASE       0x2     /* letters match in either case */
+
+#define MATCH_FRAME_SIZE  256     /* stack bytes per level of match_here */
 
 typedef enum {
         SYMBOL,          /* alphabet, '.', etc */
@@ -18,21 +27,67 @@ typedef enum {
         OP_STOP_UNION,   /* ']' */
         OP_START_CONCAT, /* '(' */
         OP_STOP_CONCAT,  /* ')' */
+        OP_START_REPEAT, /* '{' */
+        OP_STOP_REPEAT,  /* '}' */
 } element_type_t;
 
 
+typedef enum {
+        MATCH_FULL,      /* the whole input */
+        MATCH_PREFIX,    /* any prefix of the input, stop at the first */
+        MATCH_SHORTEST,  /* the shortest matching prefix */
+        MATCH_LONGEST,   /* the longest matching prefix */
+} match_mode_t;
+
+
+/* what match_regex() returns when it cannot tell */
+typedef enum {
+        MATCH_ERR_NOMEM  = -1, /* out of memory */
+        MATCH_ERR_STEPS  = -2, /* more than max_steps */
+        MATCH_ERR_MEMORY = -3, /* more than max_memory */
+        MATCH_ERR_STATES = -4, /* regex has more than max_states */
+} match_err_t;
+
+
+/*
+ * Budget of one match_regex() call, 0 means no limit. Going over it
+ * gives the MATCH_ERR_ for it, never an accept or reject.
+ */
+struct match_limits {
+        unsigned long      max_steps;   /* work, see match_regex() */
+        size_t             max_memory;  /* bytes of working memory */
+        int                max_states;
+};
+
+
 struct transition;
 struct state;
+struct counter;
 
 
 struct transition {
         struct transition *next;
-#define E 0
-        char label;                  /* 0 label = E transition */
+#define ANY     256                 /* '.' - matches any byte */
+#define RANGE   257                 /* any byte from lo to hi */
+#define E       258                 /* E transition, consumes no input */
+#define E_ENTER 259                 /* E, into a counted repetition */
+#define E_BODY  260                 /* E, one more round if count < max */
+#define E_AGAIN 261                 /* E, end of a round, count++ */
+#define E_EXIT  262                 /* E, out of it if count >= min */
+#define is_E(label) ((label) >= E)
+        int label;                  /* 0-255 = byte, or ANY, RANGE, E* */
+        uint8_t lo;
+        uint8_t hi;
         struct state *to;
 };
 
 
+struct counter {
+        int                min;         /* rounds needed to get out */
+        int                max;         /* rounds allowed */
+};
+
+
 struct state {
         struct state       *next;       /* list of all related states */
         struct state       *prev;
@@ -41,13 +96,16 @@ struct state {
         int                id;          /* Unique identifier, per state */
         int                is_start;    /* 0 = false, 1 = true */
         int                is_final;    /* 0 = false, 1 = true */
-        int                T;           /* this was added by a closure */
+        int                is_live;     /* a final state is reachable */
+        size_t             E_pos;       /* input position + 1 and count it */
+        int                E_count;     /* was last reached at, by E moves */
+        struct counter    *counter;     /* counted repetition this is in */
         struct transition *transitions; /* list of transitions from here */
 };
 
 
 element_type_t
-element_type (char element)
+element_type (uint8_t element)
 {
         element_type_t type = SYMBOL;
 
@@ -57,6 +115,8 @@ element_type (char element)
         case ')': type = OP_STOP_CONCAT; break;
         case '[': type = OP_START_UNION; break;
         case ']': type = OP_STOP_UNION; break;
+        case '{': type = OP_START_REPEAT; break;
+        case '}': type = OP_STOP_REPEAT; break;
         }
 
         return type;
@@ -168,7 +228,7 @@ new_final_state (int id)
 
 
 struct transition *
-new_transition (char label)
+new_transition (int label)
 {
         struct transition *newtrans = NULL;
 
@@ -180,7 +240,17 @@ new_transition (char label)
 
 
 int
-state_transition (struct state *from, struct state *to, char label)
+transition_matches (struct transition *trans, uint8_t byte)
+{
+        if (trans->label == RANGE)
+                return (byte >= trans->lo && byte <= trans->hi);
+
+        return (trans->label == byte || trans->label == ANY);
+}
+
+
+int
+state_transition (struct state *from, struct state *to, int label)
 {
         struct transition *newtrans = NULL;
 
@@ -196,7 +266,7 @@ state_transition (struct state *from, struct state *to, char label)
 
 
 struct state *
-add_symbol (struct state *start, char label, int idx)
+add_symbol (struct state *start, int label, int idx)
 {
         struct state *symstate = NULL;
 
@@ -212,29 +282,207 @@ add_symbol (struct state *start, char label, int idx)
 
 
 int
-E_transition_if_final (struct state *each, void *data)
+state_range_transition (struct state *from, struct state *to,
+                        uint8_t lo, uint8_t hi)
 {
-        struct state *newstate = NULL;
+        if (lo == hi)
+                return state_transition (from, to, lo);
 
-        newstate = data;
+        if (lo == 0x00 && hi == 0xff)
+                return state_transition (from, to, ANY);
 
-        if (each->is_final) {
-                state_transition (each, newstate, E);
+        state_transition (from, to, RANGE);
+
+        from->transitions->lo = lo;
+        from->transitions->hi = hi;
+
+        return 0;
+}
+
+
+struct state *
+add_range (struct state *start, uint8_t lo, uint8_t hi, int idx)
+{
+        struct state *symstate = NULL;
+
+        symstate = new_final_state (idx);
+        symstate->ch = start->ch;
+
+        state_range_transition (start, symstate, lo, hi);
+
+        state_splice (start, symstate);
+
+        return start;
+}
+
+
+int
+utf8_encode (uint32_t cp, uint8_t *buf)
+{
+        if (cp < 0x80) {
+                buf[0] = cp;
+                return 1;
+        }
+
+        if (cp < 0x800) {
+                buf[0] = 0xc0 | (cp >> 6);
+                buf[1] = 0x80 | (cp & 0x3f);
+                return 2;
+        }
+
+        if (cp < 0x10000) {
+                buf[0] = 0xe0 | (cp >> 12);
+                buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+                buf[2] = 0x80 | (cp & 0x3f);
+                return 3;
+        }
+
+        buf[0] = 0xf0 | (cp >> 18);
+        buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+        buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[3] = 0x80 | (cp & 0x3f);
+        return 4;
+}
+
+
+/* returns the length of the character at @buf, 0 if it is not UTF-8 */
+size_t
+utf8_decode (const uint8_t *buf, size_t len, uint32_t *cp)
+{
+        size_t   n = 0;
+        size_t   i = 0;
+        uint32_t min = 0;
+
+        if (buf[0] < 0x80) {
+                *cp = buf[0];
+                return 1;
+        }
+
+        if (buf[0] >= 0xc2 && buf[0] <= 0xdf) {
+                n = 2; min = 0x80; *cp = buf[0] & 0x1f;
+        } else if (buf[0] >= 0xe0 && buf[0] <= 0xef) {
+                n = 3; min = 0x800; *cp = buf[0] & 0x0f;
+        } else if (buf[0] >= 0xf0 && buf[0] <= 0xf4) {
+                n = 4; min = 0x10000; *cp = buf[0] & 0x07;
+        } else {
+                return 0;
         }
 
+        if (n > len)
+                return 0;
+
+        for (i = 1; i < n; i++) {
+                if ((buf[i] & 0xc0) != 0x80)
+                        return 0;
+                *cp = (*cp << 6) | (buf[i] & 0x3f);
+        }
+
+        if (*cp < min || *cp > 0x10ffff ||
+            (*cp >= 0xd800 && *cp <= 0xdfff))
+                return 0;
+
+        return n;
+}
+
+
+/*
+ * Add a path from @start to @done for every UTF-8 encoding of the code
+ * points @lo to @hi. The range is split until each piece encodes to a
+ * fixed sequence of byte ranges, so no decoding is needed to match.
+ */
+int
+add_utf8_paths (struct state *start, struct state *done,
+                uint32_t lo, uint32_t hi)
+{
+        static const uint32_t limits[] = { 0x7f, 0x7ff, 0xffff };
+        struct state         *prev = NULL;
+        struct state         *next = NULL;
+        uint8_t               from[4];
+        uint8_t               to[4];
+        uint32_t              m = 0;
+        int                   n = 0;
+        int                   i = 0;
+
+        if (lo > hi)
+                return 0;
+
+        /* surrogates are not characters */
+        if (lo <= 0xdfff && hi >= 0xd800) {
+                if (lo < 0xd800)
+                        add_utf8_paths (start, done, lo, 0xd7ff);
+                if (hi > 0xdfff)
+                        add_utf8_paths (start, done, 0xe000, hi);
+                return 0;
+        }
+
+        /* same encoded length */
+        for (i = 0; i < 3; i++) {
+                if (lo <= limits[i] && hi > limits[i]) {
+                        add_utf8_paths (start, done, lo, limits[i]);
+                        add_utf8_paths (start, done, limits[i] + 1, hi);
+                        return 0;
+                }
+        }
+
+        /* same leading bytes, all continuation bytes ranging fully */
+        for (i = 1; hi >= 0x80 && i < 4; i++) {
+                m = (1U << (6 * i)) - 1;
+                if ((lo & ~m) == (hi & ~m))
+                        continue;
+                if ((lo & m) != 0) {
+                        add_utf8_paths (start, done, lo, lo | m);
+                        add_utf8_paths (start, done, (lo | m) + 1, hi);
+                        return 0;
+                }
+                if ((hi & m) != m) {
+                        add_utf8_paths (start, done, lo, (hi & ~m) - 1);
+                        add_utf8_paths (start, done, hi & ~m, hi);
+                        return 0;
+                }
+        }
+
+        n = utf8_encode (lo, from);
+        utf8_encode (hi, to);
+
+        prev = start;
+        for (i = 0; i < n - 1; i++) {
+                next = new_state (done->id - 1);
+                next->ch = start->ch;
+                state_range_transition (prev, next, from[i], to[i]);
+                state_splice (start, next);
+                prev = next;
+        }
+        state_range_transition (prev, done, from[n - 1], to[n - 1]);
+
         return 0;
 }
 
 
+struct state *
+add_codepoints (struct state *start, uint32_t lo, uint32_t hi, int idx)
+{
+        struct state *done = NULL;
+
+        done = new_final_state (idx);
+        done->ch = start->ch;
+
+        add_utf8_paths (start, done, lo, hi);
+
+        state_splice (start, done);
+
+        return start;
+}
+
+
 int
-unfinalize (struct state *each, void *data)
+E_transition_if_final (struct state *each, void *data)
 {
         struct state *newstate = NULL;
 
         newstate = data;
 
         if (each->is_final) {
-                each->is_final = 0;
+                state_transition (each, newstate, E);
         }
 
         return 0;
@@ -242,14 +490,14 @@ unfinalize (struct state *each, void *data)
 
 
 int
-E_transition_if_final_and_not_T (struct state *each, void *data)
+unfinalize (struct state *each, void *data)
 {
         struct state *newstate = NULL;
 
         newstate = data;
 
-        if (each->is_final && !each->T) {
-                state_transition (each, newstate, E);
+        if (each->is_final) {
+                each->is_final = 0;
         }
 
         return 0;
@@ -259,7 +507,7 @@ E_transition_if_final_and_not_T (struct state *each, void *data)
 struct state *
 add_closure (struct state *newstate, struct state *prev)
 {
-        state_foreach (prev, E_transition_if_final_and_not_T, newstate);
+        state_foreach (prev, E_transition_if_final, newstate);
 
         newstate->is_final = 1;
         prev->is_start = 0;
@@ -304,26 +552,465 @@ add_concat (struct state *left, struct state *right)
 
 
 struct state *
-next_subex (const char *regex, int *idx, struct state *prev)
+add_optional (struct state *left, struct state *right)
 {
-        struct state *newstate = NULL;
-        struct state *subex = NULL;
-        struct state *ret = NULL;
+        /* like add_concat, but @left can still accept on its own */
+        state_foreach (left, E_transition_if_final, right);
+
+        right->is_start = 0;
+
+        state_splice (left, right);
+
+        return left;
+}
+
+
+int
+E_again_if_final (struct state *each, void *data)
+{
+        struct state *loop = NULL;
+
+        loop = data;
+
+        if (each->is_final) {
+                state_transition (each, loop, E_AGAIN);
+        }
+
+        return 0;
+}
+
+
+int
+enter_counter (struct state *each, void *data)
+{
+        struct counter *counter = NULL;
+
+        counter = data;
+
+        if (each->counter) /* already counting for an inner repetition */
+                return 1;
+
+        each->counter = counter;
+
+        return 0;
+}
+
+
+struct state *
+add_counter (struct state *newstate, struct state *subex,
+             struct counter *counter)
+{
+        struct state *loop = NULL;
+        struct state *done = NULL;
+
+        if (state_foreach (subex, enter_counter, counter)) {
+                fprintf (stderr,
+                         "RegExp has nested repetitions too large to "
+                         "unroll\n");
+                return NULL;
+        }
+
+        loop = new_state (newstate->id - 1);
+        loop->ch = newstate->ch;
+        enter_counter (loop, counter);
+
+        done = new_final_state (newstate->id - 1);
+        done->ch = newstate->ch;
 
-        switch (element_type (regex[*idx])) {
+        state_foreach (subex, E_again_if_final, loop);
+        state_foreach (subex, unfinalize, NULL);
+        subex->is_start = 0;
+
+        state_transition (newstate, loop, E_ENTER);
+        state_transition (loop, subex, E_BODY);
+        state_transition (loop, done, E_EXIT);
+
+        state_splice (newstate, loop);
+        state_splice (newstate, subex);
+        state_splice (newstate, done);
+
+        return newstate;
+}
+
+
+int
+count_state (struct state *each, void *data)
+{
+        int *count = NULL;
+
+        count = data;
+
+        (*count)++;
+
+        return 0;
+}
+
+
+struct parser {
+        const uint8_t *regex;   /* not NUL terminated */
+        size_t         len;
+        size_t         idx;     /* element being parsed */
+        int            flags;   /* REGEX_* */
+        int            in_union;
+};
+
+
+struct state *
+next_subex (struct parser *parser, struct state *prev);
+
+
+struct state *
+copy_subex (struct parser *parser, size_t atom, size_t brace, int in_union)
+{
+        struct parser copy = *parser;
+
+        /* parse regex[@atom] up to, but not including, the '{' again,
+           as directly inside [ ] if it was, for ranges */
+        copy.idx = atom;
+        copy.len = brace;
+        copy.in_union = in_union;
+
+        return next_subex (&copy, NULL);
+}
+
+
+int
+next_bound (struct parser *parser, int *bound)
+{
+        int digits = 0;
+
+        *bound = 0;
+
+        while (parser->idx < parser->len &&
+               parser->regex[parser->idx] >= '0' &&
+               parser->regex[parser->idx] <= '9') {
+                if (*bound <= REPEAT_MAX)
+                        *bound = (*bound * 10) +
+                                (parser->regex[parser->idx] - '0');
+                parser->idx++;
+                digits++;
+        }
+
+        return digits;
+}
+
+
+int
+next_bounds (struct parser *parser, int *min, int *max)
+{
+        parser->idx++; /* '{' */
+
+        if (!next_bound (parser, min))
+                return -1;
+
+        *max = *min;
+
+        if (parser->idx < parser->len && parser->regex[parser->idx] == ',') {
+                parser->idx++;
+                if (!next_bound (parser, max))
+                        *max = -1; /* {n,} */
+        }
+
+        if (parser->idx >= parser->len ||
+            element_type (parser->regex[parser->idx]) != OP_STOP_REPEAT)
+                return -1;
+
+        if (*max != -1 && *max < *min)
+                return -1;
+
+        return 0;
+}
+
+
+/*
+ * @subex was parsed from regex[@atom] up to the '{' at parser->idx.
+ * Small counts are unrolled by parsing that text once more for every
+ * copy, large ones loop through @subex with a counter instead.
+ */
+struct state *
+next_repeat (struct parser *parser, size_t atom, int in_union,
+             struct state *subex)
+{
+        size_t          brace = 0;
+        int             min = 0;
+        int             max = 0;
+        int             copies = 0;
+        int             size = 0;
+        int             i = 0;
+        struct state   *copy = NULL;
+        struct state   *opt = NULL;
+        struct state   *newstate = NULL;
+        struct state   *ret = NULL;
+        struct counter *counter = NULL;
+
+        brace = parser->idx;
+
+        if (next_bounds (parser, &min, &max) != 0) {
+                fprintf (stderr, "RegExp has a malformed {n,m}\n");
+                return NULL;
+        }
+
+        if (min > REPEAT_MAX || max > REPEAT_MAX) {
+                fprintf (stderr, "RegExp repeats more than %d times\n",
+                         REPEAT_MAX);
+                return NULL;
+        }
+
+        state_foreach (subex, count_state, &size);
+
+        copies = (max == -1) ? min + 1 : max;
+
+        if (copies > REPEAT_UNROLL_MAX) {
+                /* x{n,} is x{n} followed by x* */
+                if (max == -1)
+                        opt = copy_subex (parser, atom, brace, in_union);
+
+                newstate = new_start_state (brace);
+                newstate->ch = '{';
+
+                counter = calloc (1, sizeof (*counter));
+                counter->min = min;
+                counter->max = (max == -1) ? min : max;
+
+                ret = add_counter (newstate, subex, counter);
+                if (!ret || !opt)
+                        return ret;
+
+                newstate = new_start_state (brace);
+                newstate->ch = '*';
+
+                return add_concat (ret, add_closure (newstate, opt));
+        }
+
+        if (copies * size > STATES_MAX) {
+                fprintf (stderr, "RegExp compiles to more than %d states\n",
+                         STATES_MAX);
+                return NULL;
+        }
+
+        /* x{n,m} is n copies of x, followed by m - n optional ones */
+        for (i = 1; i <= min; i++) {
+                copy = (i == 1) ? subex :
+                        copy_subex (parser, atom, brace, in_union);
+                ret = add_concat (ret, copy);
+        }
+
+        if (max == -1) {
+                copy = (min == 0) ? subex :
+                        copy_subex (parser, atom, brace, in_union);
+
+                newstate = new_start_state (brace);
+                newstate->ch = '*';
+
+                return add_concat (ret, add_closure (newstate, copy));
+        }
+
+        for (i = max; i > min; i--) {
+                copy = (i == 1) ? subex :
+                        copy_subex (parser, atom, brace, in_union);
+                opt = opt ? add_optional (copy, opt) : copy;
+        }
+
+        if (!ret) {
+                /* x{0,m} and x{0} also accept the empty input */
+                newstate = new_final_state (brace);
+                newstate->is_start = 1;
+                newstate->ch = '{';
+
+                ret = add_concat (ret, newstate);
+        }
+
+        if (opt)
+                ret = add_optional (ret, opt);
+
+        return ret;
+}
+
+
+struct fold {
+        uint32_t           lo;
+        uint32_t           hi;
+        int                delta;       /* to the other case */
+        int                step;        /* 2 where the cases alternate */
+};
+
+
+/* simple one to one case pairs, both ways: ASCII, Latin-1,
+   Latin Extended-A, Greek and Cyrillic */
+const struct fold folds[] = {
+        { 'A',   'Z',     32, 1 }, { 'a',   'z',    -32, 1 },
+        { 0xc0,  0xd6,    32, 1 }, { 0xe0,  0xf6,   -32, 1 },
+        { 0xd8,  0xde,    32, 1 }, { 0xf8,  0xfe,   -32, 1 },
+        { 0xff,  0xff,   121, 1 }, { 0x178, 0x178, -121, 1 },
+        { 0x100, 0x12f,    1, 2 }, { 0x101, 0x12f,   -1, 2 },
+        { 0x132, 0x137,    1, 2 }, { 0x133, 0x137,   -1, 2 },
+        { 0x139, 0x148,    1, 2 }, { 0x13a, 0x148,   -1, 2 },
+        { 0x14a, 0x177,    1, 2 }, { 0x14b, 0x177,   -1, 2 },
+        { 0x179, 0x17e,    1, 2 }, { 0x17a, 0x17e,   -1, 2 },
+        { 0x386, 0x386,   38, 1 }, { 0x3ac, 0x3ac,  -38, 1 },
+        { 0x388, 0x38a,   37, 1 }, { 0x3ad, 0x3af,  -37, 1 },
+        { 0x38c, 0x38c,   64, 1 }, { 0x3cc, 0x3cc,  -64, 1 },
+        { 0x38e, 0x38f,   63, 1 }, { 0x3cd, 0x3ce,  -63, 1 },
+        { 0x391, 0x3a1,   32, 1 }, { 0x3b1, 0x3c1,  -32, 1 },
+        { 0x3a3, 0x3ab,   32, 1 }, { 0x3c3, 0x3cb,  -32, 1 },
+        { 0x3a3, 0x3a3,   31, 1 }, { 0x3c2, 0x3c2,  -31, 1 },
+        { 0x3c2, 0x3c2,    1, 1 }, { 0x3c3, 0x3c3,   -1, 1 },
+        { 0x400, 0x40f,   80, 1 }, { 0x450, 0x45f,  -80, 1 },
+        { 0x410, 0x42f,   32, 1 }, { 0x430, 0x44f,  -32, 1 },
+        { 0x460, 0x481,    1, 2 }, { 0x461, 0x481,   -1, 2 },
+        { 0x48a, 0x4bf,    1, 2 }, { 0x48b, 0x4bf,   -1, 2 },
+};
+
+
+size_t
+next_char (struct parser *parser, size_t idx, uint32_t *cp)
+{
+        if (!(parser->flags & REGEX_UTF8)) {
+                *cp = parser->regex[idx];
+                return 1;
+        }
+
+        return utf8_decode (parser->regex + idx, parser->len - idx, cp);
+}
+
+
+/*
+ * A symbol is a byte, or a whole character in UTF-8 mode. Directly
+ * inside a union 'x-y' stands for all the symbols from x to y.
+ */
+void
+add_symbols (struct parser *parser, struct state *newstate, uint32_t lo,
+             uint32_t hi)
+{
+        if (parser->flags & REGEX_UTF8)
+                add_codepoints (newstate, lo, hi, parser->idx);
+        else
+                add_range (newstate, lo, hi, parser->idx);
+}
+
+
+/*
+ * Let @newstate also take the other case of the symbols from @lo to
+ * @hi. Only ASCII letters have another case when symbols are bytes.
+ */
+void
+add_other_case (struct parser *parser, struct state *newstate, uint32_t lo,
+                uint32_t hi)
+{
+        const struct fold *fold = NULL;
+        uint32_t           a = 0;
+        uint32_t           b = 0;
+
+        for (fold = folds; fold < folds + sizeof (folds) / sizeof (*fold);
+             fold++) {
+                if (!(parser->flags & REGEX_UTF8) && fold->hi > 0x7f)
+                        continue;
+
+                a = (lo > fold->lo) ? lo : fold->lo;
+                b = (hi < fold->hi) ? hi : fold->hi;
+                if (a > b)
+                        continue;
+
+                if (fold->step == 1) {
+                        add_symbols (parser, newstate, a + fold->delta,
+                                     b + fold->delta);
+                        continue;
+                }
+
+                if ((a - fold->lo) % 2)
+                        a++;
+
+                for (; a <= b; a += 2)
+                        add_symbols (parser, newstate, a + fold->delta,
+                                     a + fold->delta);
+        }
+}
+
+
+int
+next_symbol (struct parser *parser, struct state *newstate, int in_union)
+{
+        const uint8_t *regex = NULL;
+        size_t         n = 0;
+        size_t         m = 0;
+        uint32_t       lo = 0;
+        uint32_t       hi = 0;
+
+        regex = parser->regex;
+
+        if (regex[parser->idx] == '.') {
+                if (parser->flags & REGEX_UTF8)
+                        add_codepoints (newstate, 0, 0x10ffff, parser->idx);
+                else
+                        add_symbol (newstate, ANY, parser->idx);
+                return 0;
+        }
+
+        n = next_char (parser, parser->idx, &lo);
+        hi = lo;
+
+        if (n && in_union && parser->idx + n + 1 < parser->len &&
+            regex[parser->idx + n] == '-' &&
+            regex[parser->idx + n + 1] != '.' &&
+            element_type (regex[parser->idx + n + 1]) == SYMBOL) {
+                m = next_char (parser, parser->idx + n + 1, &hi);
+                if (!m) {
+                        n = 0;
+                } else if (hi < lo) {
+                        fprintf (stderr, "RegExp has a range out of order\n");
+                        return -1;
+                } else {
+                        n += m + 1;
+                }
+        }
+
+        if (!n) {
+                fprintf (stderr, "RegExp is not valid UTF-8\n");
+                return -1;
+        }
+
+        add_symbols (parser, newstate, lo, hi);
+
+        if (parser->flags & REGEX_ICASE)
+                add_other_case (parser, newstate, lo, hi);
+
+        parser->idx += n - 1;
+
+        return 0;
+}
+
+
+struct state *
+next_subex (struct parser *parser, struct state *prev)
+{
+        const uint8_t *regex = NULL;
+        size_t         atom = 0;
+        struct state  *newstate = NULL;
+        struct state  *subex = NULL;
+        struct state  *ret = NULL;
+        int            in_union = 0;
+
+        regex = parser->regex;
+        atom = parser->idx;
+
+        /* only for elements directly inside [ ] */
+        in_union = parser->in_union;
+        parser->in_union = 0;
+
+        switch (element_type (regex[parser->idx])) {
 
         case SYMBOL:
-                newstate = new_start_state (*idx);
-                newstate->ch = regex[*idx];
+                newstate = new_start_state (parser->idx);
+                newstate->ch = regex[parser->idx];
 
-                add_symbol (newstate, regex[*idx], (*idx));
+                if (next_symbol (parser, newstate, in_union) != 0)
+                        return NULL;
                 ret = newstate;
                 break;
 
         case OP_CLOSURE:
-                newstate = new_start_state (*idx);
-                newstate->ch = regex[*idx];
-                newstate->T = 1;
+                newstate = new_start_state (parser->idx);
+                newstate->ch = regex[parser->idx];
 
                 if (!prev) {
                         fprintf (stderr,
@@ -335,30 +1022,31 @@ next_subex (const char *regex, int *idx, struct state *prev)
                    the manipulated node is really @prev
                 */
                 add_closure (newstate, prev);
-                ret = newstate;
-                break;
+                return newstate;
 
         case OP_START_UNION:
-                newstate = new_start_state (*idx);
-                newstate->ch = regex[*idx];
+                newstate = new_start_state (parser->idx);
+                newstate->ch = regex[parser->idx];
 
-                (*idx)++;
+                parser->idx++;
 
-                while (regex[*idx]) {
-                        if (element_type (regex[*idx]) == OP_STOP_UNION)
+                while (parser->idx < parser->len) {
+                        if (element_type (regex[parser->idx]) == OP_STOP_UNION)
                                 break;
 
-                        subex = next_subex (regex, idx, subex);
+                        parser->in_union = 1;
+                        subex = next_subex (parser, subex);
 
                         if (!subex)
                                 return NULL;
 
                         add_union (newstate, subex);
                         subex = newstate;
-                        (*idx)++;
+                        parser->idx++;
                 }
 
-                if (element_type (regex[*idx]) != OP_STOP_UNION) {
+                if (parser->idx >= parser->len ||
+                    element_type (regex[parser->idx]) != OP_STOP_UNION) {
                         fprintf (stderr,
                                  "RegExp is not balanced with a closing ]\n");
                         return NULL;
@@ -368,22 +1056,23 @@ next_subex (const char *regex, int *idx, struct state *prev)
                 break;
 
         case OP_START_CONCAT:
-                (*idx)++;
-                while (regex[*idx]) {
-                        if (element_type (regex[*idx]) == OP_STOP_CONCAT)
+                parser->idx++;
+                while (parser->idx < parser->len) {
+                        if (element_type (regex[parser->idx]) == OP_STOP_CONCAT)
                                 break;
 
-                        subex = next_subex (regex, idx, subex);
+                        subex = next_subex (parser, subex);
 
                         if (!subex)
                                 return NULL;
 
                         newstate = add_concat (newstate, subex);
                         subex = newstate;
-                        (*idx)++;
+                        parser->idx++;
                 }
 
-                if (element_type (regex[*idx]) != OP_STOP_CONCAT) {
+                if (parser->idx >= parser->len ||
+                    element_type (regex[parser->idx]) != OP_STOP_CONCAT) {
                         fprintf (stderr, "RegExp is not balanced with a closing )\n");
                         return NULL;
                 }
@@ -398,12 +1087,31 @@ next_subex (const char *regex, int *idx, struct state *prev)
         case OP_STOP_UNION:
                 fprintf (stderr, "RegExp is not balanced ... unexpected ']'\n");
                 return NULL;
+
+        case OP_START_REPEAT:
+                fprintf (stderr, "RegExp is not balanced ... unexpected '{'\n");
+                return NULL;
+
+        case OP_STOP_REPEAT:
+                fprintf (stderr, "RegExp is not balanced ... unexpected '}'\n");
+                return NULL;
         }
 
-        /* peek ahead */
-        if (element_type (regex[(*idx)+1]) == OP_CLOSURE) {
-                (*idx)++;
-                ret = next_subex (regex, idx, ret);
+        /* peek ahead, post-ops apply to everything parsed from @atom */
+        while (ret && parser->idx + 1 < parser->len) {
+                switch (element_type (regex[parser->idx + 1])) {
+                case OP_CLOSURE:
+                        parser->idx++;
+                        ret = next_subex (parser, ret);
+                        continue;
+                case OP_START_REPEAT:
+                        parser->idx++;
+                        ret = next_repeat (parser, atom, in_union, ret);
+                        continue;
+                default:
+                        break;
+                }
+                break;
         }
 
         return ret;
@@ -411,37 +1119,125 @@ next_subex (const char *regex, int *idx, struct state *prev)
 
 
 int
-parse_regex (struct state *start, const char *regex)
+leads_to_live (struct state *state, struct transition *each, void *data)
 {
-        int idx = 0;
+        return each->to->is_live;
+}
+
+
+int
+mark_live (struct state *state, void *data)
+{
+        int *changed = NULL;
+
+        changed = data;
+
+        if (state->is_live)
+                return 0;
+
+        if (state->is_final ||
+            transition_foreach (state, leads_to_live, NULL)) {
+                state->is_live = 1;
+                *changed = 1;
+        }
+
+        return 0;
+}
+
+
+int
+parse_regex (struct state *start, const uint8_t *regex, size_t len,
+             int flags)
+{
+        struct parser parser = { .regex = regex, .len = len,
+                                 .flags = flags };
         struct state *subex = NULL;
+        int           changed = 0;
+        int           size = 0;
 
-        while (regex[idx]) {
-                subex = next_subex (regex, &idx, start);
+        while (parser.idx < len) {
+                subex = next_subex (&parser, start);
                 if (!subex)
                         return -1;
                 add_concat (start, subex);
-                idx++;
+                parser.idx++;
+        }
+
+        state_foreach (start, count_state, &size);
+        if (size > STATES_MAX) {
+                fprintf (stderr, "RegExp compiles to more than %d states\n",
+                         STATES_MAX);
+                return -1;
         }
 
+        /* states from which no final state is reachable are dead ends,
+           the matchers give up on them early */
+        do {
+                changed = 0;
+                state_foreach (start, mark_live, &changed);
+        } while (changed);
+
         return 0;
 }
 
 
+struct match {
+        const uint8_t *buf;     /* not NUL terminated, may contain NULs */
+        size_t         len;
+        match_mode_t   mode;
+        int            matched; /* found an accepting path */
+        size_t         end;     /* end of the best match found so far */
+
+        unsigned long  max_steps;
+        unsigned long  steps;
+        size_t         max_depth;
+        size_t         depth;   /* of match_here recursion */
+        int            err;     /* MATCH_ERR_ that stopped the search */
+};
+
+
+struct input {
+        struct match  *match;
+        size_t         pos;
+        int            count;   /* rounds of the current counted repetition */
+};
+
+
 int
-match_regex (struct state *state, const char *input);
+match_here (struct state *state, struct match *match, size_t pos,
+            int count);
 
 int
 attempt_E_move (struct state *state, struct transition *each,
                 void *data)
 {
-        char *input = NULL;
-        int   ret = 0;
+        struct input *input = NULL;
+        int           ret = 0;
 
         input = data;
 
-        if (each->label == E) {
-                ret = match_regex (each->to, input);
+        switch (each->label) {
+        case E:
+                ret = match_here (each->to, input->match, input->pos,
+                                  input->count);
+                break;
+        case E_ENTER:
+                ret = match_here (each->to, input->match, input->pos, 0);
+                break;
+        case E_BODY:
+                if (input->count < state->counter->max)
+                        ret = match_here (each->to, input->match,
+                                          input->pos, input->count);
+                break;
+        case E_AGAIN:
+                ret = match_here (each->to, input->match, input->pos,
+                                  input->count + 1);
+                break;
+        case E_EXIT:
+                if (input->count >= state->counter->min)
+                        ret = match_here (each->to, input->match,
+                                          input->pos, 0);
+                break;
         }
 
         return ret;
@@ -452,62 +1248,209 @@ int
 attempt_nonE_move (struct state *state, struct transition *each,
                    void *data)
 {
-        char *input = NULL;
-        int   ret = 0;
+        struct input *input = NULL;
+        int           ret = 0;
 
         input = data;
 
-        if ((each->label == (*input)) || (each->label == '.')) {
-                ret = match_regex (each->to, input+1);
+        if (transition_matches (each, input->match->buf[input->pos])) {
+                ret = match_here (each->to, input->match, input->pos + 1,
+                                  input->count);
         }
 
         return ret;
 }
 
 
-int depth = 0;
+int
+accept_here (struct match *match, size_t pos)
+{
+        if (!match->matched ||
+            (match->mode == MATCH_LONGEST && pos > match->end) ||
+            (match->mode == MATCH_SHORTEST && pos < match->end)) {
+                match->matched = 1;
+                match->end = pos;
+        }
+
+        switch (match->mode) {
+        case MATCH_FULL:
+        case MATCH_PREFIX:
+                return 1;
+        case MATCH_SHORTEST:
+                return (pos == 0);
+        case MATCH_LONGEST:
+                return (pos == match->len);
+        }
+
+        return 0;
+}
+
 
 int
-match_regex (struct state *state, const char *input)
+match_here (struct state *state, struct match *match, size_t pos,
+            int count)
 {
-        int ret = 0;
+        struct input input = { .match = match, .pos = pos, .count = count };
+        size_t       E_pos = 0;
+        int          E_count = 0;
+        int          ret = 0;
+
+        if (!state->is_live) /* no way to accept from here */
+                return 0;
 
-#ifndef MISERIES_IN_LIFE_ARE_SOLVED
-        if (!depth)
+        if (match->mode == MATCH_SHORTEST && match->matched &&
+            pos >= match->end) /* cannot get any shorter down this path */
                 return 0;
-#endif
 
-        depth--;
+        if (state->E_pos == pos + 1 && state->E_count == count)
+                return 0; /* went round an E loop back to here */
+
+        /* every return of 1 ends the search, also when out of budget */
+        if (match->max_steps && ++match->steps > match->max_steps) {
+                match->err = MATCH_ERR_STEPS;
+                return 1;
+        }
+
+        if (match->max_depth && match->depth >= match->max_depth) {
+                match->err = MATCH_ERR_MEMORY;
+                return 1;
+        }
+
+        E_pos = state->E_pos;
+        E_count = state->E_count;
+        state->E_pos = pos + 1;
+        state->E_count = count;
+        match->depth++;
         {
                 /* check for E moves before checking end of input */
-                ret = transition_foreach (state, attempt_E_move, (void *)input);
+                ret = transition_foreach (state, attempt_E_move, &input);
         }
-        depth++;
+        match->depth--;
+        state->E_pos = E_pos;
+        state->E_count = E_count;
 
         if (ret) /* save trouble of finding more ways to accept
                     if one is already found
                  */
                 return ret;
 
-        if ((*input) == 0) { /* end of input */
+        if (state->is_final && (pos == match->len ||
+                                match->mode != MATCH_FULL)) {
+                /* current state is a final state */
+                ret = accept_here (match, pos);
+                if (ret)
+                        return ret;
+        }
 
-                if (state->is_final) { /* current state is a final state */
-                        return 1; /* accept */
+        if (pos == match->len) /* end of input */
+                return 0;
+
+        match->depth++;
+        {
+                ret = transition_foreach (state, attempt_nonE_move, &input);
+        }
+        match->depth--;
+
+        return ret;
+}
+
+
+const char *
+match_strerror (int err)
+{
+        switch (err) {
+        case MATCH_ERR_NOMEM:  return "out of memory";
+        case MATCH_ERR_STEPS:  return "too many steps";
+        case MATCH_ERR_MEMORY: return "too much memory";
+        case MATCH_ERR_STATES: return "too many states";
+        }
+
+        return "no error";
+}
+
+
+/*
+ * Run @buf through the automaton starting at @state. Returns 1 if
+ * it is accepted in @mode, with the length of the accepted prefix in
+ * @end, 0 otherwise, or a MATCH_ERR_ if it went over @limits (may be
+ * NULL). A step is one state tried at one input position, memory is
+ * the stack of tries, MATCH_FRAME_SIZE bytes each.
+ */
+int
+match_regex (struct state *state, const uint8_t *buf, size_t len,
+             match_mode_t mode, const struct match_limits *limits,
+             size_t *end)
+{
+        struct match match = {
+                .buf  = buf,
+                .len  = len,
+                .mode = mode,
+        };
+        int          size = 0;
+
+        if (limits) {
+                if (limits->max_states) {
+                        state_foreach (state, count_state, &size);
+                        if (size > limits->max_states)
+                                return MATCH_ERR_STATES;
                 }
-                return 0; /* nope */
+
+                match.max_steps = limits->max_steps;
+                match.max_depth = limits->max_memory / MATCH_FRAME_SIZE;
+                if (limits->max_memory && !match.max_depth)
+                        return MATCH_ERR_MEMORY;
         }
 
-        ret = transition_foreach (state, attempt_nonE_move, (void *)input);
+        match_here (state, &match, 0, 0);
 
-        return ret;
+        if (match.err)
+                return match.err;
+
+        if (match.matched)
+                *end = match.end;
+
+        return match.matched;
+}
+
+
+/*
+ * The number given to option @opt, in @arg: decimal, or hex or octal
+ * as strtoul() reads them, and at most @max. Anything else, a sign or
+ * trailing junk included, is an error. Returns 0 if @value was set.
+ */
+int
+option_number (int opt, const char *arg, unsigned long max,
+               unsigned long *value)
+{
+        char *end = NULL;
+
+        errno = 0;
+        if (*arg >= '0' && *arg <= '9')
+                *value = strtoul (arg, &end, 0);
+
+        if (!end || *end || errno || *value > max) {
+                fprintf (stderr, "RegExp option -%c wants a number from 0 "
+                         "to %lu, not \"%s\"\n", opt, max, arg);
+                return -1;
+        }
+
+        return 0;
 }
 
 
 int
 main (int argc, char *argv[])
 {
-        char *regex = NULL;
-        char *input = NULL;
+        char         *regex = NULL;
+        char         *input = NULL;
+        match_mode_t  mode = MATCH_FULL;
+        size_t        end = 0;
+        unsigned long number = 0;
+        int           flags = 0;
+        int           opt = 0;
+        int           ret = 0;
+
+        struct match_limits limits = { 0, };
 
         /* Hardcoded start state, to kick-start */
         struct state start = {
@@ -519,22 +1462,60 @@ main (int argc, char *argv[])
                 .transitions = NULL,
         };
 
-        if (argc != 3) {
-                fprintf (stderr, "Usage: %s <regex> <input>\n",
+        while ((opt = getopt (argc, argv, "fpsluiS:M:N:")) != -1) {
+                switch (opt) {
+                case 'S':
+                        if (option_number (opt, optarg, ULONG_MAX, &number))
+                                return 2;
+                        limits.max_steps = number;
+                        break;
+                case 'M':
+                        if (option_number (opt, optarg, SIZE_MAX, &number))
+                                return 2;
+                        limits.max_memory = number;
+                        break;
+                case 'N':
+                        if (option_number (opt, optarg, INT_MAX, &number))
+                                return 2;
+                        limits.max_states = number;
+                        break;
+                case 'u': flags |= REGEX_UTF8; break;
+                case 'i': flags |= REGEX_ICASE; break;
+                case 'f': mode = MATCH_FULL; break;
+                case 'p': mode = MATCH_PREFIX; break;
+                case 's': mode = MATCH_SHORTEST; break;
+                case 'l': mode = MATCH_LONGEST; break;
+                default:
+                        argc = 0;
+                }
+        }
+
+        if (argc - optind != 2) {
+                fprintf (stderr,
+                         "Usage: %s [-f|-p|-s|-l] [-u] [-i] [-S steps] "
+                         "[-M bytes] [-N states] <regex> <input>\n",
                          argv[0]);
                 return 1;
         }
 
-        regex = argv[1];
-        input = argv[2];
+        regex = argv[optind];
+        input = argv[optind + 1];
 
-        if (parse_regex (&start, regex) != 0) {
+        if (parse_regex (&start, (const uint8_t *) regex,
+                         strlen (regex), flags) != 0) {
                 return 1;
         }
 
-        depth = DEPTH_OF_MISERY;
-        if (match_regex (&start, input) == 1) {
-                printf ("%s accepts %s\n", regex, input);
+        ret = match_regex (&start, (const uint8_t *) input, strlen (input),
+                           mode, &limits, &end);
+        if (ret < 0) {
+                fprintf (stderr, "RegExp gave up: %s\n",
+                         match_strerror (ret));
+                return 2;
+        }
+
+        if (ret == 1) {
+                printf ("%s accepts %.*s\n", regex, (int) end, input);
         } else {
                 printf ("%s does not accept %s\n", regex, input);
         }
@@ -0,0 +1,725 @@
+/*
+ * regexp.hpp - RegExps known at compile time, in C++20
+ *
+ * The same syntax as regexp-match-bfs.c (see README), parsed and
+ * turned into a DFA by the compiler:
+ *
+ *   if (regexp::match<"[(GET)(HEAD)] /[a-z0-9/]*"> (line)) ...
+ *   static_assert (regexp::search<"ab*c"> ("xxabbbcx"));
+ *
+ * match() is true if all of the input matches, search() if some part
+ * of it does. Each is a loop over the input with one lookup per byte
+ * in tables that are constants of the program: nothing is parsed,
+ * allocated or called through a pointer when it runs. A pattern the
+ * C code would reject does not compile, nor does one starting with a
+ * '*' or whose DFA would have more than DFA_MAX states. Bytes only,
+ * RegExps that need -u or -i, or only known at run time, go through
+ * the C code.
+ */
+
+#ifndef REGEXP_HPP
+#define REGEXP_HPP
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace regexp {
+
+constexpr std::size_t NFA_MAX = 1 << 16; /* most NFA states, unrolled */
+constexpr std::size_t DFA_MAX = 4096;    /* most DFA states */
+
+
+/* a pattern, as a template argument: regexp::match<"ab*"> */
+template <std::size_t N>
+struct pattern {
+        char bytes[N];
+
+        constexpr pattern (const char (&text)[N])
+        {
+                for (std::size_t i = 0; i < N; i++)
+                        bytes[i] = text[i];
+        }
+
+        constexpr std::string_view
+        view () const
+        {
+                return std::string_view (bytes, N - 1);
+        }
+};
+
+
+namespace detail {
+
+/*
+ * Not constexpr: reaching it while compiling a pattern stops the
+ * compile, with the message in the error.
+ */
+inline void
+error (const char *)
+{
+}
+
+
+enum element_type_t {
+        SYMBOL,
+        OP_CLOSURE,
+        OP_START_UNION,
+        OP_STOP_UNION,
+        OP_START_CONCAT,
+        OP_STOP_CONCAT,
+        OP_START_REPEAT,
+        OP_STOP_REPEAT,
+};
+
+
+constexpr element_type_t
+element_type (char element)
+{
+        switch (element) {
+        case '*': return OP_CLOSURE;
+        case '(': return OP_START_CONCAT;
+        case ')': return OP_STOP_CONCAT;
+        case '[': return OP_START_UNION;
+        case ']': return OP_STOP_UNION;
+        case '{': return OP_START_REPEAT;
+        case '}': return OP_STOP_REPEAT;
+        default:  return SYMBOL;
+        }
+}
+
+
+/* from one NFA state to another on lo..hi, or an E transition */
+struct transition {
+        int lo;                         /* -1 for E */
+        int hi;
+        int to;
+};
+
+
+/*
+ * A piece of the NFA: the states first..last-1, entered at start and
+ * left from end. Everything inside a piece was added while parsing it,
+ * so it can be copied as a block, which is how x{n,m} is unrolled.
+ */
+struct piece {
+        int first;
+        int last;
+        int start;
+        int end;
+};
+
+
+struct nfa {
+        std::string_view                     regex;
+        std::size_t                          idx = 0;
+        std::vector<std::vector<transition>> states;
+        int                                  start = 0;
+        int                                  final = 0;
+
+        constexpr int
+        new_state ()
+        {
+                if (states.size () >= NFA_MAX)
+                        error ("RegExp compiles to more than NFA_MAX states");
+                states.emplace_back ();
+                return states.size () - 1;
+        }
+
+        constexpr void
+        add (int from, int lo, int hi, int to)
+        {
+                states[from].push_back (transition { lo, hi, to });
+        }
+
+        constexpr piece
+        symbol (int lo, int hi)
+        {
+                int from = new_state ();
+                int to = new_state ();
+
+                add (from, lo, hi, to);
+
+                return piece { from, to + 1, from, to };
+        }
+
+        constexpr piece
+        empty ()
+        {
+                int state = new_state ();
+
+                return piece { state, state + 1, state, state };
+        }
+
+        constexpr piece
+        concat (piece left, piece right)
+        {
+                add (left.end, -1, -1, right.start);
+
+                return piece { left.first, right.last, left.start,
+                               right.end };
+        }
+
+        constexpr piece
+        closure (piece body)
+        {
+                int start = new_state ();
+                int end = new_state ();
+
+                add (start, -1, -1, body.start);
+                add (start, -1, -1, end);
+                add (body.end, -1, -1, body.start);
+                add (body.end, -1, -1, end);
+
+                return piece { body.first, end + 1, start, end };
+        }
+
+        constexpr piece
+        optional (piece body)
+        {
+                int start = new_state ();
+                int end = new_state ();
+
+                add (start, -1, -1, body.start);
+                add (start, -1, -1, end);
+                add (body.end, -1, -1, end);
+
+                return piece { body.first, end + 1, start, end };
+        }
+
+        constexpr piece
+        copy (piece of)
+        {
+                int offset = states.size () - of.first;
+                int n = 0;
+
+                for (n = of.first; n < of.last; n++) {
+                        new_state ();
+                        for (transition each : states[n])
+                                add (n + offset, each.lo, each.hi,
+                                     each.to + offset);
+                }
+
+                return piece { of.first + offset, of.last + offset,
+                               of.start + offset, of.end + offset };
+        }
+
+        constexpr bool
+        next_bound (int &bound)
+        {
+                int digits = 0;
+
+                bound = 0;
+                while (idx < regex.size () && regex[idx] >= '0' &&
+                       regex[idx] <= '9') {
+                        if (bound <= 65535)
+                                bound = bound * 10 + (regex[idx] - '0');
+                        idx++;
+                        digits++;
+                }
+
+                return digits > 0;
+        }
+
+        /*
+         * x{n,m} is n copies of x, followed by m - n optional ones. The
+         * copies are all made before any is joined to another, a copy
+         * of a piece has to be of it alone.
+         */
+        constexpr piece
+        next_repeat (piece subex)
+        {
+                std::vector<piece> copies;
+                piece              ret {};
+                int                min = 0;
+                int                max = 0;
+                int                i = 0;
+
+                idx++; /* '{' */
+
+                if (!next_bound (min))
+                        error ("RegExp has a malformed {n,m}");
+                max = min;
+                if (idx < regex.size () && regex[idx] == ',') {
+                        idx++;
+                        if (!next_bound (max))
+                                max = -1; /* {n,} */
+                }
+                if (idx >= regex.size () ||
+                    element_type (regex[idx]) != OP_STOP_REPEAT ||
+                    (max != -1 && max < min))
+                        error ("RegExp has a malformed {n,m}");
+                if (min > 65535 || max > 65535)
+                        error ("RegExp repeats more than 65535 times");
+
+                copies.push_back (subex);
+                for (i = 1; i < (max == -1 ? min + 1 : max); i++)
+                        copies.push_back (copy (subex));
+
+                if (min == 0) {
+                        /* still a block, from the first state of x */
+                        ret = empty ();
+                        ret.first = subex.first;
+                } else {
+                        ret = copies[0];
+                }
+                for (i = 1; i < min; i++)
+                        ret = concat (ret, copies[i]);
+
+                if (max == -1)
+                        return concat (ret, closure (copies[min]));
+
+                for (i = min; i < max; i++)
+                        ret = concat (ret, optional (copies[i]));
+
+                return ret;
+        }
+
+        constexpr piece
+        next_symbol (bool in_union)
+        {
+                int lo = 0;
+                int hi = 0;
+
+                if (regex[idx] == '.')
+                        return symbol (0, 255);
+
+                lo = hi = (unsigned char) regex[idx];
+
+                if (in_union && idx + 2 < regex.size () &&
+                    regex[idx + 1] == '-' && regex[idx + 2] != '.' &&
+                    element_type (regex[idx + 2]) == SYMBOL) {
+                        hi = (unsigned char) regex[idx + 2];
+                        if (hi < lo)
+                                error ("RegExp has a range out of order");
+                        idx += 2;
+                }
+
+                return symbol (lo, hi);
+        }
+
+        constexpr piece
+        next_subex (bool in_union)
+        {
+                piece ret {};
+                piece subex {};
+                int   start = 0;
+                int   end = 0;
+                bool  some = false;
+
+                switch (element_type (regex[idx])) {
+
+                case SYMBOL:
+                        ret = next_symbol (in_union);
+                        break;
+
+                case OP_START_UNION:
+                        idx++;
+                        ret.first = states.size ();
+                        while (idx < regex.size () &&
+                               element_type (regex[idx]) != OP_STOP_UNION) {
+                                subex = next_subex (true);
+                                if (!some)
+                                        ret.first = subex.first;
+                                some = true;
+                                start = new_state ();
+                                end = new_state ();
+                                if (ret.last) {
+                                        add (start, -1, -1, ret.start);
+                                        add (ret.end, -1, -1, end);
+                                }
+                                add (start, -1, -1, subex.start);
+                                add (subex.end, -1, -1, end);
+                                ret = piece { ret.first, end + 1, start,
+                                              end };
+                                idx++;
+                        }
+                        if (idx >= regex.size ())
+                                error ("RegExp is not balanced with a "
+                                       "closing ]");
+                        if (!some) {
+                                /* [] matches nothing */
+                                start = new_state ();
+                                end = new_state ();
+                                ret = piece { start, end + 1, start, end };
+                        }
+                        break;
+
+                case OP_START_CONCAT:
+                        idx++;
+                        while (idx < regex.size () &&
+                               element_type (regex[idx]) != OP_STOP_CONCAT) {
+                                subex = next_subex (false);
+                                ret = some ? concat (ret, subex) : subex;
+                                some = true;
+                                idx++;
+                        }
+                        if (idx >= regex.size ())
+                                error ("RegExp is not balanced with a "
+                                       "closing )");
+                        if (!some)
+                                error ("RegExp has an empty ( )");
+                        break;
+
+                case OP_CLOSURE:
+                        error ("RegExp is not balanced. unexpected *");
+                        break;
+
+                case OP_STOP_CONCAT:
+                        error ("RegExp is not balanced ... unexpected ')'");
+                        break;
+
+                case OP_STOP_UNION:
+                        error ("RegExp is not balanced ... unexpected ']'");
+                        break;
+
+                case OP_START_REPEAT:
+                        error ("RegExp is not balanced ... unexpected '{'");
+                        break;
+
+                case OP_STOP_REPEAT:
+                        error ("RegExp is not balanced ... unexpected '}'");
+                        break;
+                }
+
+                /* peek ahead, post-ops apply to everything parsed so far */
+                while (idx + 1 < regex.size ()) {
+                        if (element_type (regex[idx + 1]) == OP_CLOSURE) {
+                                idx++;
+                                ret = closure (ret);
+                        } else if (element_type (regex[idx + 1]) ==
+                                   OP_START_REPEAT) {
+                                idx++;
+                                ret = next_repeat (ret);
+                        } else {
+                                break;
+                        }
+                }
+
+                return ret;
+        }
+
+        constexpr nfa (std::string_view pattern)
+                : regex (pattern)
+        {
+                piece ret = empty ();
+
+                while (idx < regex.size ()) {
+                        ret = concat (ret, next_subex (false));
+                        idx++;
+                }
+
+                start = ret.start;
+                final = ret.end;
+        }
+};
+
+
+/*
+ * The DFA, by subset construction over byte classes as dfa_build()
+ * does. State 0 is the empty set, the dead state. With @search the
+ * start state is added back after every byte and final states are
+ * never left.
+ */
+struct dfa {
+        std::array<std::uint8_t, 256> classes {};
+        int                           nclasses = 0;
+        int                           words = 0;
+        std::vector<std::uint64_t>    sets;  /* [state * words] */
+        std::vector<std::uint64_t>    kept;  /* NFA states sets keep */
+        std::vector<int>              next;  /* [state * nclasses + class] */
+        std::vector<bool>             final;
+        std::vector<int>              table; /* hash of sets, state + 1 */
+        int                           nstates = 0;
+        int                           start = 0;
+
+        constexpr dfa (std::string_view pattern, bool search)
+        {
+                nfa                        nfa (pattern);
+                std::array<bool, 257>      starts {};
+                std::vector<std::uint64_t> row;
+                std::vector<int>           stack;
+                std::uint64_t              bits = 0;
+                int                        c = 0;
+                int                        q = 0;
+                int                        w = 0;
+                int                        n = 0;
+
+                /* classes: bytes no transition tells apart */
+                starts[0] = true;
+                for (auto &state : nfa.states) {
+                        for (transition each : state) {
+                                if (each.lo < 0)
+                                        continue;
+                                starts[each.lo] = true;
+                                starts[each.hi + 1] = true;
+                        }
+                }
+                for (c = 0; c < 256; c++) {
+                        nclasses += starts[c];
+                        classes[c] = nclasses - 1;
+                }
+
+                /* sets only keep states that read a byte, and the final
+                   one: those differing in the others are the same */
+                words = (nfa.states.size () + 63) / 64;
+                kept.assign (words, 0);
+                for (n = 0; n < (int) nfa.states.size (); n++) {
+                        for (transition each : nfa.states[n]) {
+                                if (each.lo >= 0)
+                                        kept[n / 64] |= 1ULL << (n % 64);
+                        }
+                }
+                kept[nfa.final / 64] |= 1ULL << (nfa.final % 64);
+
+                table.assign (64, 0);
+                row.assign ((std::size_t) nclasses * words, 0);
+
+                add_state (row.data (), nfa);   /* dead */
+
+                closure (row.data (), stack, nfa, nfa.start);
+                start = add_state (row.data (), nfa);
+
+                /* states get added at the end while their rows are filled,
+                   all classes of a row in one pass over its NFA states */
+                for (q = 0; q < nstates; q++) {
+                        if (search && final[q]) {
+                                for (c = 0; c < nclasses; c++)
+                                        next[q * nclasses + c] = q;
+                                continue;
+                        }
+
+                        row.assign ((std::size_t) nclasses * words, 0);
+                        for (w = 0; w < words; w++) {
+                                bits = sets[(std::size_t) q * words + w];
+                                while (bits) {
+                                        n = w * 64 + std::countr_zero (bits);
+                                        bits &= bits - 1;
+                                        step (row, stack, nfa, n);
+                                }
+                        }
+
+                        for (c = 0; c < nclasses; c++) {
+                                if (search)
+                                        closure (row.data () + c * words,
+                                                 stack, nfa, nfa.start);
+                                n = add_state (row.data () + c * words, nfa);
+                                next[q * nclasses + c] = n;
+                        }
+                }
+        }
+
+        /* add @state and all it reaches by E transitions to @set */
+        static constexpr void
+        closure (std::uint64_t *set, std::vector<int> &stack, const nfa &nfa,
+                 int state)
+        {
+                if (set[state / 64] & (1ULL << (state % 64)))
+                        return;
+                set[state / 64] |= 1ULL << (state % 64);
+                stack.push_back (state);
+
+                while (!stack.empty ()) {
+                        state = stack.back ();
+                        stack.pop_back ();
+
+                        for (transition each : nfa.states[state]) {
+                                if (each.lo >= 0 ||
+                                    (set[each.to / 64] &
+                                     (1ULL << (each.to % 64))))
+                                        continue;
+                                set[each.to / 64] |= 1ULL << (each.to % 64);
+                                stack.push_back (each.to);
+                        }
+                }
+        }
+
+        /* where NFA state @n goes, into the set of each class in @row */
+        constexpr void
+        step (std::vector<std::uint64_t> &row, std::vector<int> &stack,
+              const nfa &nfa, int n) const
+        {
+                int c = 0;
+
+                for (transition each : nfa.states[n]) {
+                        if (each.lo < 0)
+                                continue;
+                        for (c = classes[each.lo]; c <= classes[each.hi]; c++)
+                                closure (row.data () + c * words, stack, nfa,
+                                         each.to);
+                }
+        }
+
+        constexpr std::size_t
+        hash (const std::uint64_t *set) const
+        {
+                std::uint64_t h = 0;
+                int           w = 0;
+
+                for (w = 0; w < words; w++)
+                        h = (h ^ set[w]) * 0x9e3779b97f4a7c15ULL;
+
+                return (h ^ (h >> 29)) & (table.size () - 1);
+        }
+
+        constexpr bool
+        same (int q, const std::uint64_t *set) const
+        {
+                int w = 0;
+
+                for (w = 0; w < words; w++) {
+                        if (sets[(std::size_t) q * words + w] != set[w])
+                                return false;
+                }
+
+                return true;
+        }
+
+        /* the DFA state for @set, added if it is new */
+        constexpr int
+        add_state (std::uint64_t *set, const nfa &nfa)
+        {
+                std::size_t h = 0;
+                int         q = 0;
+                int         w = 0;
+
+                for (w = 0; w < words; w++)
+                        set[w] &= kept[w];
+
+                for (h = hash (set); table[h];
+                     h = (h + 1) & (table.size () - 1)) {
+                        if (same (table[h] - 1, set))
+                                return table[h] - 1;
+                }
+
+                if ((std::size_t) nstates >= DFA_MAX)
+                        error ("RegExp has more than DFA_MAX DFA states, "
+                               "use the C code");
+
+                sets.insert (sets.end (), set, set + words);
+                next.resize (next.size () + nclasses);
+                final.push_back (set[nfa.final / 64] &
+                                 (1ULL << (nfa.final % 64)));
+                table[h] = ++nstates;
+
+                /* keep it at most half full */
+                if ((std::size_t) nstates * 2 > table.size ()) {
+                        table.assign (table.size () * 2, 0);
+                        for (q = 0; q < nstates; q++) {
+                                h = hash (sets.data () +
+                                          (std::size_t) q * words);
+                                while (table[h])
+                                        h = (h + 1) & (table.size () - 1);
+                                table[h] = q + 1;
+                        }
+                }
+
+                return nstates - 1;
+        }
+};
+
+
+/* the tables of the DFA of @P, constants of the program */
+template <pattern P, bool Search>
+struct automaton {
+        static constexpr auto sizes = [] {
+                dfa dfa (P.view (), Search);
+
+                return std::array<int, 2> { dfa.nstates, dfa.nclasses };
+        } ();
+
+        static constexpr int nstates = sizes[0];
+        static constexpr int nclasses = sizes[1];
+
+        using state_t = std::conditional_t<nstates <= 256, std::uint8_t,
+                                           std::uint16_t>;
+
+        struct tables {
+                std::array<std::uint8_t, 256>           classes;
+                std::array<state_t, nstates * nclasses> next;
+                std::array<bool, nstates>               final;
+                state_t                                 start;
+        };
+
+        static constexpr tables built = [] {
+                dfa    dfa (P.view (), Search);
+                tables t {};
+                int    n = 0;
+
+                t.classes = dfa.classes;
+                for (n = 0; n < nstates * nclasses; n++)
+                        t.next[n] = dfa.next[n];
+                for (n = 0; n < nstates; n++)
+                        t.final[n] = dfa.final[n];
+                t.start = dfa.start;
+
+                return t;
+        } ();
+};
+
+} /* namespace detail */
+
+
+/* the matcher of @P, e.g. using valid = regexp::regex<"[a-z]*"> */
+template <pattern P>
+struct regex {
+        /* whether all of @input matches */
+        static constexpr bool
+        match (std::string_view input) noexcept
+        {
+                using automaton = detail::automaton<P, false>;
+                constexpr const auto &dfa = automaton::built;
+                unsigned q = dfa.start;
+
+                for (unsigned char c : input) {
+                        q = dfa.next[q * automaton::nclasses +
+                                     dfa.classes[c]];
+                        if (q == 0)
+                                return false;
+                }
+
+                return dfa.final[q];
+        }
+
+        /* whether some part of @input matches */
+        static constexpr bool
+        search (std::string_view input) noexcept
+        {
+                using automaton = detail::automaton<P, true>;
+                constexpr const auto &dfa = automaton::built;
+                unsigned q = dfa.start;
+
+                for (unsigned char c : input) {
+                        if (dfa.final[q])
+                                return true;
+                        q = dfa.next[q * automaton::nclasses +
+                                     dfa.classes[c]];
+                }
+
+                return dfa.final[q];
+        }
+};
+
+
+template <pattern P>
+constexpr bool
+match (std::string_view input) noexcept
+{
+        return regex<P>::match (input);
+}
+
+
+template <pattern P>
+constexpr bool
+search (std::string_view input) noexcept
+{
+        return regex<P>::search (input);
+}
+
+} /* namespace regexp */
+
+#endif /* REGEXP_HPP */
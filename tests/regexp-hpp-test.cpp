@@ -0,0 +1,96 @@
+/*
+ * regexp-hpp-test.cpp - checks of regexp.hpp
+ *
+ * The static_asserts are checked by compiling it. Run without
+ * arguments it prints the RegExps of its table, one per line; run with
+ * "-" it reads lines "<regex>\t<input>" of those RegExps and prints
+ * for each whether match() and search() take the input, as "1 0". The
+ * answers are compared with regexp-match-bfs -b -f and -b -a by
+ * tests/run-tests.py.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include "../regexp.hpp"
+
+static_assert (regexp::match<"ab*c"> ("abbbc"));
+static_assert (!regexp::match<"ab*c"> ("abbbcx"));
+static_assert (regexp::search<"ab*c"> ("xxabbbcx"));
+static_assert (!regexp::search<"ab*c"> ("xxabbbx"));
+static_assert (regexp::match<"[(GET)(HEAD)] /[a-z0-9/]*"> ("HEAD /a/b1"));
+static_assert (!regexp::match<"[(GET)(HEAD)] /[a-z0-9/]*"> ("PUT /a"));
+static_assert (regexp::match<"(a{2,3}b)"> ("aaab"));
+static_assert (!regexp::match<"(a{2,3}b)"> ("aaaab"));
+static_assert (regexp::search<"[(he)(she)(his)(hers)]"> ("ushers"));
+static_assert (regexp::match<"a*"> (""));
+static_assert (!regexp::search<"x"> (""));
+
+
+/* a RegExp of the table, with its two matchers */
+struct entry {
+        const char *regex;
+        bool      (*match) (std::string_view) noexcept;
+        bool      (*search) (std::string_view) noexcept;
+};
+
+#define ENTRY(p) { p, regexp::match<p>, regexp::search<p> }
+
+static const entry entries[] = {
+        ENTRY ("a*b"),
+        ENTRY ("ab*c"),
+        ENTRY ("(a[bc]*d)"),
+        ENTRY ("(.a.)"),
+        ENTRY ("(x[a-c]*x)"),
+        ENTRY ("([ab]*a[ab][ab])"),
+        ENTRY ("(a{2,3}b{1,})"),
+        ENTRY ("(a{3}[bc]{0,2})"),
+        ENTRY ("([a-c{2}]x)"),
+        ENTRY ("[(ab)(ba)(abc)]"),
+        ENTRY ("[(he)(she)(his)(hers)]"),
+};
+
+
+int
+main (int argc, char *argv[])
+{
+        std::string line;
+
+        if (argc < 2 || std::strcmp (argv[1], "-") != 0) {
+                for (const entry &e : entries)
+                        std::printf ("%s\n", e.regex);
+                return 0;
+        }
+
+        while (std::getline (std::cin, line)) {
+                std::size_t       tab = line.find ('\t');
+                std::string_view  regex;
+                std::string_view  input;
+                const entry      *found = nullptr;
+
+                if (tab == std::string::npos) {
+                        std::fprintf (stderr, "RegExp test: no tab in %s\n",
+                                      line.c_str ());
+                        return 1;
+                }
+                regex = std::string_view (line).substr (0, tab);
+                input = std::string_view (line).substr (tab + 1);
+
+                for (const entry &e : entries)
+                        if (regex == e.regex)
+                                found = &e;
+                if (!found) {
+                        std::fprintf (stderr, "RegExp test: no %s\n",
+                                      line.c_str ());
+                        return 1;
+                }
+
+                std::printf ("%d %d\n", found->match (input),
+                             found->search (input));
+        }
+
+        return 0;
+}
@@ -0,0 +1,410 @@
+#!/usr/bin/env python3
+#
+# Checks of regexp-match-bfs and regexp-match, run as programs.
+#
+#   tests/run-tests.py [check...]
+#
+# builds both with gcc into a temporary directory and runs the named
+# checks, or all of them. Exit status is 1 if any failed.
+
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+
+TOP = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BIN = tempfile.mkdtemp(prefix="regexp-tests-")
+BFS = os.path.join(BIN, "regexp-match-bfs")
+DFS = os.path.join(BIN, "regexp-match")
+
+
+def build():
+    subprocess.run(["gcc", "-O2", "-o", BFS,
+                    os.path.join(TOP, "regexp-match-bfs.c"), "-lpthread"],
+                   check=True)
+    subprocess.run(["gcc", "-O2", "-o", DFS,
+                    os.path.join(TOP, "regexp-match.c")], check=True)
+
+
+def run(args, stdin=b"", timeout=60):
+    return subprocess.run(args, input=stdin, capture_output=True,
+                          timeout=timeout)
+
+
+def accepts(binary, args):
+    out = run([binary] + args).stdout.decode("utf-8", "replace")
+    return " accepts " in out or out.rstrip().endswith(" accepts")
+
+
+def fail(what):
+    raise AssertionError(what)
+
+
+def cache_stats(err):
+    # RegExp cache: H hits, M misses, E evicted, N kept in B bytes
+    words = err.decode().strip().split("\n")[-1].split()
+    return {"hits": int(words[2]), "misses": int(words[4]),
+            "evicted": int(words[6]), "kept": int(words[8]),
+            "bytes": int(words[11])}
+
+
+def dot_counts(out):
+    # the count in each state's label, by state
+    return {name: int(count) for name, count in
+            re.findall(r'(\w+) \[label="\d+\\n(\d+)"', out.decode())}
+
+
+def check_cache():
+    """-b compiles through the cache, which evicts by size, LRU first"""
+    patterns = ["(%s[a-z]*)" % c for c in "abcdefghij"]
+
+    one = run([BFS, "-b", "-"], ("%s\tx\n" % patterns[0]).encode())
+    size = cache_stats(one.stderr)["bytes"]
+
+    lines = "".join("%s\t%sx\n" % (p, p[1]) for p in patterns * 2)
+
+    big = run([BFS, "-b", "-"], lines.encode())
+    stats = cache_stats(big.stderr)
+    if (stats["hits"], stats["misses"], stats["evicted"]) != (10, 10, 0):
+        fail("large cache: %s" % stats)
+    if big.stdout.decode().count("\n") != 20:
+        fail("large cache: %r" % big.stdout)
+
+    # room for about three: going round ten always misses
+    limit = size * 3 + size // 2
+    small = run([BFS, "-b", "-C", str(limit), "-"], lines.encode())
+    stats = cache_stats(small.stderr)
+    if stats["hits"] != 0 or stats["misses"] != 20 or \
+       stats["evicted"] != 17 or stats["bytes"] > limit:
+        fail("small cache: %s" % stats)
+    if small.stdout != big.stdout:
+        fail("small cache answers differ")
+
+    # the one used every other line is never the least recent
+    lines = "".join("%s\tx\n%s\tx\n" % (patterns[0], p)
+                    for p in patterns[1:])
+    stats = cache_stats(run([BFS, "-b", "-C", str(size * 2 + size // 2),
+                             "-"], lines.encode()).stderr)
+    if stats["hits"] != 8 or stats["misses"] != 10:
+        fail("recently used evicted: %s" % stats)
+
+
+def check_flows():
+    """-F answers for each flow as -b does on all its packets"""
+    for pattern, mode in (("([abcx][abcx])*", "-f"),
+                          ("([abx]*c[abx]*c)*[abx]*", "-f"),
+                          ("[(aaaa)(cxcx)]", "-a")):
+        flows = [""] * 200
+        packets = []
+        for _ in range(3000):
+            flow = random.randrange(len(flows))
+            text = "".join(random.choice("abcx")
+                           for _ in range(random.randint(0, 9)))
+            flows[flow] += text
+            packets.append("%d %s\n" % (flow, text))
+            if random.random() < 0.01:
+                packets.append("\n")
+
+        got = run([BFS, "-F"] + (["-a"] if mode == "-a" else []) +
+                  [pattern, "-"], "".join(packets).encode())
+        want = run([BFS, "-b", mode, "-"],
+                   "".join("%s\t%s\n" % (pattern, flow)
+                           for flow in flows).encode())
+        accepts = [line.startswith(pattern + " accepts")
+                   for line in want.stdout.decode().split("\n")]
+        want = "".join("%s %s flow %d, %d bytes\n" % (
+                       pattern, "accepts" if accepts[i] else "does not accept",
+                       i, len(flow)) for i, flow in enumerate(flows))
+        if got.stdout.decode() != want:
+            fail("%s %s: %r" % (mode, pattern, got.stdout[:200]))
+
+
+def check_grep_dead():
+    """a line on which every state died is no match, mapped or read"""
+    path = os.path.join(BIN, "lines")
+    with open(path, "w") as f:
+        f.write("aaa\nbbb\nxaaaa\n")
+    for pattern, lines in (("(a{100}[])", b""), ("a{3}", b"aaa\nxaaaa\n")):
+        for args in ([], ["-r"]):
+            out = run([BFS, "-g"] + args + [pattern, path]).stdout
+            if out != lines:
+                fail("%s %s: %r" % (" ".join(args), pattern, out))
+            out = run([BFS, "-g", "-c"] + args + [pattern, path]).stdout
+            if out != b"%d\n" % lines.count(b"\n"):
+                fail("-c %s %s: %r" % (" ".join(args), pattern, out))
+
+
+def check_grep_names():
+    """-g -L prints the names of the files with a matching line"""
+    paths = [os.path.join(BIN, name) for name in ("names1", "names2")]
+    for path, text in zip(paths, ("abc\nxyz\n", "xyz\n" * 10000)):
+        with open(path, "w") as f:
+            f.write(text)
+    for pattern, want in (("a", paths[:1]), ("y", paths), ("q", [])):
+        for args in ([], ["-r"]):
+            out = run([BFS, "-g", "-L"] + args + [pattern] + paths).stdout
+            if out.decode().split() != want:
+                fail("%s %s: %r" % (" ".join(args), pattern, out))
+
+
+def check_dot():
+    """-d and -D count each arrival in a state, and each transition"""
+    for args, final in ((["-d", "-a"], "q5"), (["-D", "-a"], "d3")):
+        counts = dot_counts(run([BFS] + args + ["(a*b)", "xaab"]).stdout)
+        if counts.get(final) != 1:
+            fail("%s: %r" % (" ".join(args), counts))
+
+    # arrived in once at the start, then once per byte: no byte here
+    # leads to the dead state, which is not drawn
+    for text in ("aab", "abba", "bbbbbb", "a" * 50):
+        out = run([BFS, "-D", "-f", "([ab]*a[ab])", text]).stdout
+        counts = dot_counts(out)
+        edges = re.findall(r'-> (d\d+) \[label="[^"]* \((\d+)\)"',
+                           out.decode())
+        start = re.search(r"start -> (d\d+)", out.decode()).group(1)
+        if sum(counts.values()) != len(text) + 1:
+            fail("-D %s: %r" % (text, counts))
+        for name, count in counts.items():
+            arrived = sum(int(n) for to, n in edges if to == name)
+            if count != arrived + (name == start):
+                fail("-D %s: %s %d, %d arrived" % (text, name, count,
+                                                   arrived))
+
+
+def check_edits():
+    """-E after random edits answers as -b does on the whole document"""
+    # each depends on all of the document, and is true about half the time
+    for pattern, mode in (("([abcx][abcx])*", "-f"),
+                          ("([abx]*c[abx]*c)*[abx]*", "-f"),
+                          ("[(aaaaaaaa)(cxcxcxcx)]", "-a")):
+        doc = ""
+        edits = []
+        batch = []
+        for _ in range(300):
+            at = random.randint(0, len(doc))
+            removed = random.randint(0, min(len(doc) - at,
+                                            random.choice([4, 4, 9000])))
+            size = random.choice([0, 4, 4, 9000 if len(doc) < 50000 else 4])
+            text = "".join(random.choice("abcx")
+                           for _ in range(random.randint(0, size)))
+            doc = doc[:at] + text + doc[at + removed:]
+            edits.append("%d %d %s\n" % (at, removed, text))
+            batch.append("%s\t%s\n" % (pattern, doc))
+
+        got = run([BFS, "-E"] + (["-a"] if mode == "-a" else []) +
+                  [pattern, "-"], "".join(edits).encode())
+        want = run([BFS, "-b", mode, "-"], "".join(batch).encode())
+        got = [b" accepts " in line for line in got.stdout.split(b"\n")]
+        want = [line.startswith(pattern.encode() + b" accepts")
+                for line in want.stdout.split(b"\n")]
+        if len(got) != len(edits) + 1 or got != want:
+            fail("%s %s: %d answers, %d wrong" % (
+                 mode, pattern, len(got) - 1,
+                 sum(a != b for a, b in zip(got, want))))
+
+
+def check_literal_sets():
+    """the Aho-Corasick DFA of a set of words answers as the NFA does"""
+    many = ["".join(random.choice("abc")
+                    for _ in range(random.randint(1, 8)))
+            for _ in range(2000)]
+    sets = (["he", "she", "his", "hers"], ["a", "ab"], ["ab", "a", "ab"],
+            ["abc", "b", "bcd", "c"], [], many)
+    for words in sets:
+        pattern = "[%s]" % "".join("(%s)" % word for word in words)
+        letters = "".join(sorted(set("".join(words)))) or "a"
+        texts = [""] + words[:10] + [
+            "".join(random.choice(letters + letters.upper() + "x")
+                    for _ in range(random.randint(1, 12)))
+            for _ in range(20)]
+        for text in texts:
+            for args in (["-f"], ["-a"], ["-f", "-i"], ["-a", "-i"]):
+                dfa = run([BFS, "-e", "dfa"] + args + [pattern, text])
+                nfa = run([BFS, "-e", "nfa"] + args + [pattern, text])
+                if dfa.stdout != nfa.stdout or dfa.returncode != 0:
+                    fail("%s %s %s: %r" % (" ".join(args), pattern[:40],
+                                           text, dfa.stdout[-40:]))
+
+
+def check_limit_options():
+    """-S, -M, -N, -C and -j take a number and nothing else"""
+    for binary, opts in ((BFS, ("-S", "-M", "-N", "-C", "-j")),
+                         (DFS, ("-S", "-M", "-N"))):
+        name = os.path.basename(binary)
+        for opt in opts:
+            for arg in ("-1", "12abc", "", " 5", "x", "9" * 30):
+                out = run([binary, opt, arg, "a", "a"])
+                if out.returncode != 2 or not out.stderr.startswith(
+                        b"RegExp option " + opt.encode()):
+                    fail("%s %s %r: %d" % (name, opt, arg, out.returncode))
+            for arg in ("0", "1000000", "0x100000"):
+                out = run([binary, opt, arg, "a", "a"])
+                if out.returncode != 0 or out.stdout != b"a accepts a\n":
+                    fail("%s %s %r: %r" % (name, opt, arg, out.stderr))
+        out = run([binary, "-N", "2147483648", "a", "a"])
+        if out.returncode != 2:
+            fail("%s -N past INT_MAX: %r" % (name, out.stdout))
+
+
+def check_limits():
+    """-S, -M and -N hold for NFA searches as well as for matches"""
+    for args in (["-S", "1"], ["-M", "10"], ["-N", "2"]):
+        for pattern in ("a*b", "x[a-z]*ab"):
+            for mode in (["-e", "nfa"], ["-a"]):
+                out = run([BFS] + args + mode + [pattern, "xaaaab"])
+                if out.returncode != 2 or b"gave up" not in out.stderr:
+                    fail("%s %s %s: %r" % (" ".join(args), " ".join(mode),
+                                           pattern, out.stdout))
+
+
+def check_engine_required():
+    """-e auto searches long inputs on the DFA when one can be built"""
+    out = run([BFS, "-e", "auto", "-a", "x[a-z]*ab", "ab" * 5000])
+    if not out.stderr.startswith(b"RegExp engine: dfa"):
+        fail("DFA possible: %r" % out.stderr)
+    out = run([BFS, "-e", "auto", "-a", "x{20}[a-z]*ab", "ab" * 5000])
+    if not out.stderr.startswith(b"RegExp engine: nfa"):
+        fail("counters: %r" % out.stderr)
+
+
+def check_onepass():
+    """one-pass RegExps answer as the NFA does, others fall back to it"""
+    for pattern, onepass in (("a*[(bc)(x)]y", True), ("(a{2}b*c)", True),
+                             ("([(ab)(c)]*d)", True), ("(x[a-c]y)", True),
+                             ("(a*b*)", True),
+                             ("([ab]*a[ab])", False), ("[(ab)(ac)]", False)):
+        letters = sorted(set(c for c in pattern if c.isalpha())) + ["z"]
+        for _ in range(30):
+            text = "".join(random.choice(letters)
+                           for _ in range(random.randint(0, 8)))
+            for mode in ("-f", "-p", "-s", "-l"):
+                got = run([BFS, "-e", "onepass", mode, pattern, text])
+                want = run([BFS, "-e", "nfa", mode, pattern, text])
+                used = got.stderr.startswith(b"RegExp engine: onepass")
+                if got.stdout != want.stdout or used != onepass:
+                    fail("%s %s %s: %r %r" % (mode, pattern, text,
+                                              got.stdout, got.stderr))
+
+
+def check_parallel():
+    """-j 4 answers as -j 1 and the NFA do on inputs split into parts"""
+    path = os.path.join(BIN, "parts")
+    for size in (150000, 300000):
+        with open(path, "w") as f:
+            f.write("".join(random.choice("abcx") for _ in range(size)))
+        for pattern in ("([abcx][abcx])*", "([abx]*c[abx]*c)*[abx]*",
+                        "(aaaaaaa)"):
+            for mode in ("-f", "-p", "-s", "-l", "-a"):
+                answers = [run([BFS, "-m"] + args + [mode, pattern, path])
+                           for args in (["-j", "4"], ["-j", "1"],
+                                        ["-e", "nfa"])]
+                if len(set(out.stdout for out in answers)) != 1:
+                    fail("%s %s, %d bytes: %r" % (
+                         mode, pattern, size,
+                         [out.stdout.replace(path.encode(), b"")
+                          for out in answers]))
+
+
+def check_range_counted():
+    """a range inside an unrolled {n,m} is the whole range every time"""
+    for binary in (BFS, DFS):
+        for pattern, texts in (("[a-c{2}]", ("aa", "bc", "ca", "cc")),
+                               ("(x{1,2}[a-c{2,3}])",
+                                ("xab", "xxcc", "xbca", "xxaaa"))):
+            for text in texts + ("a", "ad", "xxxab", "xaaaa", "dd"):
+                want = text in texts
+                if accepts(binary, ["-f", pattern, text]) != want:
+                    fail("%s: %s %s" % (os.path.basename(binary), pattern,
+                                        text))
+
+
+def check_regexp_hpp():
+    """regexp.hpp compiles, and answers as -b -f and -b -a do"""
+    test = os.path.join(BIN, "regexp-hpp-test")
+    subprocess.run(["g++", "-std=c++20", "-O2", "-Wall", "-o", test,
+                    os.path.join(TOP, "tests", "regexp-hpp-test.cpp")],
+                   check=True)
+    patterns = run([test]).stdout.decode().split("\n")[:-1]
+    lines = []
+    for _ in range(5000):
+        # the letters of the RegExp, so that some inputs match all of it
+        regex = random.choice(patterns)
+        letters = sorted(set(c for c in regex if c.isalpha())) + ["z"]
+        text = "".join(random.choice(letters)
+                       for _ in range(random.randint(0, 6)))
+        lines.append("%s\t%s\n" % (regex, text))
+    lines = "".join(lines).encode()
+
+    got = run([test, "-"], lines).stdout.split(b"\n")[:-1]
+    for i, mode in enumerate(("-f", "-a")):
+        want = run([BFS, "-b", mode, "-"], lines).stdout.split(b"\n")[:-1]
+        for line, answer, asked in zip(want, got, lines.split(b"\n")):
+            regex = asked.split(b"\t")[0]
+            accepts = line.startswith(regex + b" accepts")
+            if accepts != (answer.split()[i] == b"1"):
+                fail("%s %r: %r" % (mode, asked, answer))
+        if len(want) != len(got):
+            fail("%s: %d answers, %d wanted" % (mode, len(got), len(want)))
+
+
+def check_required_linear():
+    """the stretches around a required string are not run twice"""
+    path = os.path.join(BIN, "abab")
+    with open(path, "w") as f:
+        f.write("ab" * 20000 + "\n")
+    # a second each is plenty: running from the start at every "ab"
+    # took minutes
+    out = run([BFS, "-g", "-c", "x{20}[a-z]*ab", path], timeout=1)
+    if out.stdout != b"0\n":
+        fail("-g -c: %r" % out.stdout)
+    out = run([BFS, "-a", "-m", "x[a-z]*ab", path], timeout=1)
+    if b"does not accept" not in out.stdout:
+        fail("-a -m: %r" % out.stdout)
+    with open(path, "a") as f:
+        f.write("x" * 20 + "ab\n")
+    out = run([BFS, "-g", "-c", "x{20}[a-z]*ab", path], timeout=1)
+    if out.stdout != b"1\n":
+        fail("-g -c, matching: %r" % out.stdout)
+
+
+def check_sigma():
+    """-u -i: Σ, σ and final ς are all one letter, ΄ and ϡ are not"""
+    for binary in (BFS, DFS):
+        for pattern in ("Σ", "σ", "ς", "[Σ-Σ]", "x[ς]"):
+            for text in ("Σ", "σ", "ς", "΄", "ϡ"):
+                if pattern[0] == "x":
+                    text = "x" + text
+                want = text[-1] in "Σσς"
+                if accepts(binary, ["-u", "-i", pattern, text]) != want:
+                    fail("%s: %s %s" % (os.path.basename(binary), pattern,
+                                        text))
+
+
+CHECKS = [(name[6:], func) for name, func in sorted(globals().items())
+          if name.startswith("check_")]
+
+
+def main():
+    names = sys.argv[1:] or [name for name, _ in CHECKS]
+    failed = 0
+
+    build()
+    random.seed(1)
+
+    for name, func in CHECKS:
+        if name not in names:
+            continue
+        try:
+            func()
+            print("ok   %s" % name)
+        except (AssertionError, subprocess.TimeoutExpired) as err:
+            print("FAIL %s: %s" % (name, err))
+            failed = 1
+
+    return failed
+
+
+if __name__ == "__main__":
+    sys.exit(main())